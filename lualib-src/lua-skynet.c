@@ -11,6 +11,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+
+#if defined(__APPLE__)
+#include <sys/time.h>
+#endif
 
 struct snlua {
 	lua_State * L;
@@ -82,6 +87,25 @@ forward_cb(struct skynet_context * context, void * ud, int type, int session, ui
 	return 1;
 }
 
+// The function of callback is cached in the stack of main thread by _cb,
+// drop it at the next message after the callback is changed, because
+// lcallback may be called in the callback (ie. launch from a pooled snlua).
+static int
+reload_cb(struct skynet_context * context, void * ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	lua_State *L = ud;
+	lua_settop(L, 0);
+	skynet_callback(context, ud, _cb);
+	return _cb(context, ud, type, session, source, msg, sz);
+}
+
+static int
+reload_forward_cb(struct skynet_context * context, void * ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	lua_State *L = ud;
+	lua_settop(L, 0);
+	skynet_callback(context, ud, forward_cb);
+	return forward_cb(context, ud, type, session, source, msg, sz);
+}
+
 static int
 lcallback(lua_State *L) {
 	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
@@ -94,9 +118,9 @@ lcallback(lua_State *L) {
 	lua_State *gL = lua_tothread(L,-1);
 
 	if (forward) {
-		skynet_callback(context, gL, forward_cb);
+		skynet_callback(context, gL, reload_forward_cb);
 	} else {
-		skynet_callback(context, gL, _cb);
+		skynet_callback(context, gL, reload_cb);
 	}
 
 	return 0;
@@ -223,6 +247,11 @@ send_message(lua_State *L, int source, int idx_type) {
 		luaL_error(L, "invalid param %s", lua_typename(L, lua_type(L,idx_type+2)));
 	}
 	if (session < 0) {
+		if (session == SKYNET_SATURATED) {
+			// the destination is above its high watermark
+			lua_pushboolean(L, 0);
+			return 1;
+		}
 		// send to invalid address
 		// todo: maybe throw an error would be better
 		return 0;
@@ -261,6 +290,94 @@ lredirect(lua_State *L) {
 	return send_message(L, source, 3);
 }
 
+// the messages packed by skynet.pack are owned by send_batch, free them when it fails
+static void
+sendbatch_free(lua_State *L, int len) {
+	int i;
+	for (i=1;i<=len;i++) {
+		if (lua_rawgeti(L, 3, i) == LUA_TLIGHTUSERDATA) {
+			skynet_free(lua_touserdata(L, -1));
+		}
+		lua_pop(L, 1);
+	}
+}
+
+/*
+	uint32 address
+	 string address
+	integer type
+	table messages : a sequence of string, or lightuserdata followed by integer len
+
+	return the number of messages, nil when the address is invalid, or false when it's saturated
+ */
+static int
+lsendbatch(lua_State *L) {
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	uint32_t dest = (uint32_t)lua_tointeger(L, 1);
+	if (dest == 0) {
+		if (lua_type(L,1) == LUA_TNUMBER) {
+			return luaL_error(L, "Invalid service address 0");
+		}
+		dest = skynet_queryname(context, get_dest_string(L, 1));
+		if (dest == 0) {
+			return 0;
+		}
+	}
+	int type = luaL_checkinteger(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int len = lua_rawlen(L, 3);
+	int i, n = 0;
+	// check all the messages before copying any of them, so an error leaks nothing
+	for (i=1;i<=len;i++) {
+		int t = lua_rawgeti(L, 3, i);
+		if (t == LUA_TLIGHTUSERDATA) {
+			if (lua_rawgeti(L, 3, ++i) != LUA_TNUMBER || !lua_isinteger(L, -1)) {
+				sendbatch_free(L, len);
+				return luaL_error(L, "need the size of message %d in send_batch", n+1);
+			}
+			lua_pop(L, 1);
+		} else if (t != LUA_TSTRING) {
+			sendbatch_free(L, len);
+			return luaL_error(L, "invalid message %s in send_batch", lua_typename(L, t));
+		}
+		lua_pop(L, 1);
+		++n;
+	}
+	void ** msg = lua_newuserdata(L, n * (sizeof(void *) + sizeof(size_t)));
+	size_t * sz = (size_t *)(msg + n);
+	n = 0;
+	for (i=1;i<=len;i++) {
+		if (lua_rawgeti(L, 3, i) == LUA_TSTRING) {
+			size_t size = 0;
+			const char * str = lua_tolstring(L, -1, &size);
+			// copy it now, so all the messages can be sent with PTYPE_TAG_DONTCOPY
+			void * data = NULL;
+			if (size > 0) {
+				data = skynet_malloc(size);
+				memcpy(data, str, size);
+			}
+			msg[n] = data;
+			sz[n] = size;
+		} else {
+			msg[n] = lua_touserdata(L, -1);
+			lua_rawgeti(L, 3, ++i);
+			sz[n] = (size_t)lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		++n;
+	}
+	int ret = skynet_send_batch(context, 0, dest, type | PTYPE_TAG_DONTCOPY, n, msg, sz);
+	if (ret == SKYNET_SATURATED) {
+		lua_pushboolean(L, 0);
+		return 1;
+	} else if (ret) {
+		return 0;
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
 static int
 lerror(lua_State *L) {
 	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
@@ -346,6 +463,23 @@ lnow(lua_State *L) {
 	return 1;
 }
 
+// high performance counter in nanosecond, for benchmark
+static int
+lhpc(lua_State *L) {
+	uint64_t t;
+#if !defined(__APPLE__)
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	t = (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	t = (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#endif
+	lua_pushinteger(L, t);
+	return 1;
+}
+
 LUAMOD_API int
 luaopen_skynet_core(lua_State *L) {
 	luaL_checkversion(L);
@@ -354,6 +488,7 @@ luaopen_skynet_core(lua_State *L) {
 		{ "send" , lsend },
 		{ "genid", lgenid },
 		{ "redirect", lredirect },
+		{ "sendbatch", lsendbatch },
 		{ "command" , lcommand },
 		{ "intcommand", lintcommand },
 		{ "error", lerror },
@@ -365,6 +500,7 @@ luaopen_skynet_core(lua_State *L) {
 		{ "trash" , ltrash },
 		{ "callback", lcallback },
 		{ "now", lnow },
+		{ "hpc", lhpc },
 		{ NULL, NULL },
 	};
 
@@ -655,6 +655,52 @@ ludp_send(lua_State *L) {
 	return 1;
 }
 
+/*
+	userdata batch
+	integer size
+
+	return a table of the packages in a SKYNET_SOCKET_TYPE_UDPBATCH message : { data1, address1, data2, address2, ... }
+ */
+static int
+ludpbatch(lua_State *L) {
+	const uint8_t * p = lua_touserdata(L,1);
+	int size = luaL_checkinteger(L,2);
+	if (p == NULL) {
+		return luaL_error(L, "Invalid udp batch");
+	}
+	const uint8_t * end = p + size;
+	lua_newtable(L);
+	int n = 0;
+	while (p < end) {
+		// 2 bytes size, 1 byte address size, then the package and the address
+		if (end - p < 3) {
+			return luaL_error(L, "Invalid udp batch");
+		}
+		uint16_t sz;
+		memcpy(&sz, p, sizeof(sz));
+		int addrsz = p[2];
+		p += 3;
+		if (end - p < sz + addrsz) {
+			return luaL_error(L, "Invalid udp batch");
+		}
+		lua_pushlstring(L, (const char *)p, sz);
+		lua_rawseti(L, -2, ++n);
+		lua_pushlstring(L, (const char *)p + sz, addrsz);
+		lua_rawseti(L, -2, ++n);
+		p += sz + addrsz;
+	}
+	return 1;
+}
+
+static int
+lsendstat(lua_State *L) {
+	uint64_t syscall, message;
+	skynet_socket_sendstat(&syscall, &message);
+	lua_pushinteger(L, (lua_Integer)syscall);
+	lua_pushinteger(L, (lua_Integer)message);
+	return 2;
+}
+
 static int
 ludp_address(lua_State *L) {
 	size_t sz = 0;
@@ -696,6 +742,8 @@ luaopen_socketdriver(lua_State *L) {
 		{ "header", lheader },
 
 		{ "unpack", lunpack },
+		{ "sendstat", lsendstat },
+		{ "udpbatch", ludpbatch },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
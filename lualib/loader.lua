@@ -1,48 +1,87 @@
-local args = {}
-for word in string.gmatch(..., "%S+") do
-	table.insert(args, word)
-end
+local STANDBY = "@standby"	-- a pre-warmed snlua in the pool of launcher, see service/launcher.lua
 
-SERVICE_NAME = args[1]
+local service_pattern = LUA_SERVICE
 
-local main, pattern
+LUA_SERVICE = nil
+package.path , LUA_PATH = LUA_PATH
+package.cpath , LUA_CPATH = LUA_CPATH
 
-local err = {}
-for pat in string.gmatch(LUA_SERVICE, "([^;]+);*") do
-	local filename = string.gsub(pat, "?", SERVICE_NAME)
-	local f, msg = loadfile(filename)
-	if not f then
-		table.insert(err, msg)
-	else
-		pattern = pat
-		main = f
-		break
+local function launch(param)
+	local args = {}
+	for word in string.gmatch(param, "%S+") do
+		table.insert(args, word)
 	end
-end
 
-if not main then
-	error(table.concat(err, "\n"))
-end
+	SERVICE_NAME = args[1]
 
-LUA_SERVICE = nil
-package.path , LUA_PATH = LUA_PATH
-package.cpath , LUA_CPATH = LUA_CPATH
+	local main, pattern
+
+	local err = {}
+	for pat in string.gmatch(service_pattern, "([^;]+);*") do
+		local filename = string.gsub(pat, "?", SERVICE_NAME)
+		local f, msg = loadfile(filename)
+		if not f then
+			table.insert(err, msg)
+		else
+			pattern = pat
+			main = f
+			break
+		end
+	end
 
-local service_path = string.match(pattern, "(.*/)[^/?]+$")
+	if not main then
+		error(table.concat(err, "\n"))
+	end
+
+	local service_path = string.match(pattern, "(.*/)[^/?]+$")
+
+	if service_path then
+		service_path = string.gsub(service_path, "?", args[1])
+		package.path = service_path .. "?.lua;" .. package.path
+		SERVICE_PATH = service_path
+	else
+		local p = string.match(pattern, "(.*/).+$")
+		SERVICE_PATH = p
+	end
+
+	if LUA_PRELOAD then
+		local f = assert(loadfile(LUA_PRELOAD))
+		f(table.unpack(args))
+		LUA_PRELOAD = nil
+	end
 
-if service_path then
-	service_path = string.gsub(service_path, "?", args[1])
-	package.path = service_path .. "?.lua;" .. package.path
-	SERVICE_PATH = service_path
-else
-	local p = string.match(pattern, "(.*/).+$")
-	SERVICE_PATH = p
+	main(select(2, table.unpack(args)))
 end
 
-if LUA_PRELOAD then
-	local f = assert(loadfile(LUA_PRELOAD))
-	f(table.unpack(args))
-	LUA_PRELOAD = nil
+local param = ...
+
+if param ~= STANDBY then
+	launch(param)
+	return
 end
 
-main(select(2, table.unpack(args)))
+-- 预热的服务: 先加载 skynet.lua ，等 launcher 发来真正的启动参数后再加载服务脚本
+local skynet = require "skynet"
+local c = require "skynet.core"
+local started = false
+local launcher = skynet.localname ".launcher"
+
+c.callback(function(prototype, msg, sz, session, source)
+	-- 只接受 launcher 发来的启动参数，其它消息忽略
+	if started or prototype ~= skynet.PTYPE_TEXT or source ~= launcher then
+		return
+	end
+	started = true
+	local param = c.tostring(msg, sz)
+	skynet.error("LAUNCH snlua " .. param)
+	-- the service replaces this callback by skynet.start
+	local ok, err = xpcall(launch, debug.traceback, param)
+	if not ok then
+		skynet.error("lua loader error : " .. tostring(err))
+		c.send(".launcher", skynet.PTYPE_TEXT, 0, "ERROR")
+		c.command("EXIT")
+	end
+end)
+
+-- ready to use
+c.send(".launcher", skynet.PTYPE_TEXT, 0, "")
@@ -124,7 +124,12 @@ local function dispatch_wakeup()
 	if co then
 		local session = sleep_session[co]
 		if session then
-			session_id_coroutine[session] = "BREAK"
+			if c.intcommand("CANCELTIMEOUT", session) then
+				session_id_coroutine[session] = nil
+			else
+				-- the timeout is fired, or it's not a timer (skynet.wait)
+				session_id_coroutine[session] = "BREAK"
+			end
 			return suspend(co, coroutine_resume(co, false, "BREAK"))
 		end
 	end
@@ -262,16 +267,14 @@ function suspend(co, result, command, param, size)
 	dispatch_error_queue()
 end
 
-function skynet.timeout(ti, func)
-	local session = c.intcommand("TIMEOUT",ti)
+local function timeout(session, func)
 	assert(session)
 	local co = co_create(func)
 	assert(session_id_coroutine[session] == nil)
 	session_id_coroutine[session] = co
 end
 
-function skynet.sleep(ti)
-	local session = c.intcommand("TIMEOUT",ti)
+local function sleep(session)
 	assert(session)
 	local succ, ret = coroutine_yield("SLEEP", session)
 	sleep_session[coroutine.running()] = nil
@@ -285,6 +288,51 @@ function skynet.sleep(ti)
 	end
 end
 
+-- ti 单位 1/100 秒，返回的 id 可以用 skynet.cancel_timeout 取消
+function skynet.timeout(ti, func)
+	local session = c.intcommand("TIMEOUT",ti)
+	timeout(session, func)
+	return session
+end
+
+function skynet.sleep(ti)
+	return sleep(c.intcommand("TIMEOUT",ti))
+end
+
+-- ti 单位毫秒，精度取决于 config 中的 timer_resolution ，默认是 10 毫秒
+function skynet.timeout_ms(ti, func)
+	local session = c.intcommand("TIMEOUTMS",ti)
+	timeout(session, func)
+	return session
+end
+
+-- 和 skynet.timeout 一样，用于大量服务各自设置相同超时的情况(比如心跳)
+-- 同一个 tick 到期的定时器在时间轮里共用一个节点，cancel_timeout 只是丢弃到期的消息
+function skynet.timeout_group(ti, func)
+	local session = c.intcommand("TIMEOUTGROUP",ti)
+	timeout(session, func)
+	return session
+end
+
+-- id 是 skynet.timeout (或 timeout_ms, timeout_group) 的返回值，返回 false 表示它已经执行过了
+function skynet.cancel_timeout(id)
+	local co = session_id_coroutine[id]
+	if co == nil or co == "BREAK" then
+		return false
+	end
+	if c.intcommand("CANCELTIMEOUT", id) then
+		session_id_coroutine[id] = nil
+	else
+		-- the response is on the way, drop it
+		session_id_coroutine[id] = "BREAK"
+	end
+	return true
+end
+
+function skynet.sleep_ms(ti)
+	return sleep(c.intcommand("TIMEOUTMS",ti))
+end
+
 function skynet.yield()
 	return skynet.sleep(0)
 end
@@ -306,6 +354,8 @@ function skynet.self()
 	return self_handle
 end
 
+-- resolve a local name (".name") to the handle. A name is bound until its service exits,
+-- so the handle can be cached to skip the name lookup on each send.
 function skynet.localname(name)
 	local addr = c.command("QUERY", name)
 	if addr then
@@ -314,6 +364,7 @@ function skynet.localname(name)
 end
 
 skynet.now = c.now
+skynet.hpc = c.hpc	-- high performance counter in nanosecond
 
 local starttime
 
@@ -372,6 +423,21 @@ function skynet.rawsend(addr, typename, msg, sz)
 	return c.send(addr, p.id, 0 , msg, sz)
 end
 
+-- send a list of messages to one address in one push.
+-- each item of list is a table of the arguments for the pack function of typename
+function skynet.send_batch(addr, typename, list)
+	local p = proto[typename]
+	local msgs = {}
+	for i = 1, #list do
+		local msg, sz = p.pack(table.unpack(list[i]))
+		msgs[#msgs+1] = msg
+		if sz then
+			msgs[#msgs+1] = sz
+		end
+	end
+	return c.sendbatch(addr, p.id, msgs)
+end
+
 skynet.genid = assert(c.genid)
 
 skynet.redirect = function(dest,source,typename,...)
@@ -399,13 +465,18 @@ function skynet.call(addr, typename, ...)
 	local session = c.send(addr, p.id , nil , p.pack(...))
 	if session == nil then
 		error("call to invalid address " .. skynet.address(addr))
+	elseif session == false then
+		error("call to saturated service " .. skynet.address(addr))
 	end
 	return p.unpack(yield_call(addr, session))
 end
 
 function skynet.rawcall(addr, typename, msg, sz)
 	local p = proto[typename]
-	local session = assert(c.send(addr, p.id , nil , msg, sz), "call to invalid address")
+	local session = c.send(addr, p.id , nil , msg, sz)
+	if not session then
+		error(session == false and "call to saturated service" or "call to invalid address")
+	end
 	return yield_call(addr, session)
 end
 
@@ -540,6 +611,11 @@ function skynet.newservice(name, ...)
 	return skynet.call(".launcher", "lua" , "LAUNCH", "snlua", name, ...)
 end
 
+-- 启动 n 个相同的服务，返回地址列表，启动失败的位置为 false
+function skynet.newservices(n, name, ...)
+	return skynet.call(".launcher", "lua" , "LAUNCHN", n, "snlua", name, ...)
+end
+
 function skynet.uniqueservice(global, ...)
 	if global == true then
 		return assert(skynet.call(".service", "lua", "GLAUNCH", ...))
@@ -661,6 +737,42 @@ function skynet.mqlen()
 	return c.intcommand("STAT", "mqlen")
 end
 
+-- set the watermark of the message queue of self. when the length reaches high, the sender gets false
+-- (or the message is dropped silently for policy "drop"), and the sockets of self stop reading, until
+-- the length falls to low. high == 0 disables it.
+-- return length, high, low, saturated when high is nil
+function skynet.watermark(high, low, policy)
+	if high == nil then
+		local len, h, l, saturated = c.command("WATERMARK"):match("(%d+) (%d+) (%d+) (%d+)")
+		return tonumber(len), tonumber(h), tonumber(l), saturated == "1"
+	end
+	c.command("WATERMARK", string.format("%d %d %s", high, low or -1, policy or "reject"))
+end
+
+-- set the scheduling priority class ("high", "normal" or "low") of addr (default is self)
+-- return the current class of self when level is nil
+function skynet.priority(level, addr)
+	if level == nil then
+		return c.command("PRIORITY")
+	end
+	if addr then
+		level = skynet.address(addr) .. " " .. level
+	end
+	return c.command("PRIORITY", level)
+end
+
+-- the number of services waiting in each priority class of the run queue
+function skynet.runqueue()
+	local high, normal, low = c.command("RUNQUEUE"):match("(%d+) (%d+) (%d+)")
+	return { high = tonumber(high), normal = tonumber(normal), low = tonumber(low) }
+end
+
+-- how many times the timer thread wakes up late, and the max lag in millisecond
+function skynet.timerskew()
+	local count, maxlag = c.command("TIMERSKEW"):match("(%d+) (%d+)")
+	return { count = tonumber(count), maxlag = tonumber(maxlag) }
+end
+
 function skynet.stat(what)
 	return c.intcommand("STAT", what)
 end
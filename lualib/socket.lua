@@ -140,6 +140,29 @@ socket_message[6] = function(id, size, data, address)
 	s.callback(str, address)
 end
 
+-- SKYNET_SOCKET_TYPE_UDPBATCH = 8
+--一次读到的多个udp包，依次调用回调函数
+socket_message[8] = function(id, size, data)
+	local s = socket_pool[id]
+	if s == nil or s.callback == nil then
+		skynet.error("socket: drop udp package from " .. id)
+		driver.drop(data, size)
+		return
+	end
+	-- free the batch even if it is broken
+	local ok, pkgs = pcall(driver.udpbatch, data, size)
+	skynet_core.trash(data, size)
+	if not ok then
+		error(pkgs)
+	end
+	for i = 1, #pkgs, 2 do
+		if socket_pool[id] ~= s then
+			break	-- closed by the callback
+		end
+		s.callback(pkgs[i], pkgs[i+1])
+	end
+end
+
 local function default_warning(id, size)
 	local s = socket_pool[id]
 	if not s then
@@ -367,6 +390,8 @@ end
 socket.write = assert(driver.send)
 socket.lwrite = assert(driver.lsend)
 socket.header = assert(driver.header)
+--返回发送数据的系统调用次数和发送完的包数，用来看合并发送的效果
+socket.sendstat = assert(driver.sendstat)
 
 function socket.invalid(id)
 	return socket_pool[id] == nil
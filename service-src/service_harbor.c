@@ -316,12 +316,17 @@ forward_local_messsage(struct harbor *h, void *msg, int sz) {
 	int type = destination >> HANDLE_REMOTE_SHIFT;
 	destination = (destination & HANDLE_MASK) | ((uint32_t)h->id << HANDLE_REMOTE_SHIFT);
 
-	if (skynet_send(h->ctx, header.source, destination, type | PTYPE_TAG_DONTCOPY , (int)header.session, (void *)msg, sz-HEADER_COOKIE_LENGTH) < 0) {
+	int ret = skynet_send(h->ctx, header.source, destination, type | PTYPE_TAG_DONTCOPY , (int)header.session, (void *)msg, sz-HEADER_COOKIE_LENGTH);
+	if (ret < 0) {
 		if (type != PTYPE_ERROR) {
 			// don't need report error when type is error
 			skynet_send(h->ctx, destination, header.source , PTYPE_ERROR, (int)header.session, NULL, 0);
 		}
-		skynet_error(h->ctx, "Unknown destination :%x from :%x type(%d)", destination, header.source, type);
+		if (ret == SKYNET_SATURATED) {
+			skynet_error(h->ctx, "Destination :%x is saturated, drop message from :%x type(%d)", destination, header.source, type);
+		} else {
+			skynet_error(h->ctx, "Unknown destination :%x from :%x type(%d)", destination, header.source, type);
+		}
 	}
 }
 
@@ -507,6 +512,7 @@ update_name(struct harbor *h, const char name[GLOBALNAME_LENGTH], uint32_t handl
 		node = hash_insert(h->map, name);
 	}
 	node->value = handle;
+	skynet_harbor_setname(name, handle);
 	if (node->queue) {
 		dispatch_name_queue(h, node);
 		release_queue(node->queue);
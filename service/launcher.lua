@@ -7,6 +7,32 @@ local services = {}
 local command = {}
 local instance = {} -- for confirm (function command.LAUNCH / command.ERROR / command.LAUNCHOK)
 
+-- 预热的 snlua 服务池 (config snlua_pool) ，见 lualib/loader.lua
+local STANDBY = "@standby"
+local pool_size = tonumber(skynet.getenv "snlua_pool") or 0
+local pool = {}	-- ready standby services
+local pending = {}	-- standby services not ready yet
+local npending = 0
+local filling = false
+local fill_pool
+
+-- a standby service exits or is killed before use, don't hand it out
+local function remove_standby(handle)
+	if pending[handle] then
+		pending[handle] = nil
+		npending = npending - 1
+		fill_pool()
+		return
+	end
+	for i = 1, #pool do
+		if pool[i] == handle then
+			table.remove(pool, i)
+			fill_pool()
+			return
+		end
+	end
+end
+
 local function handle_to_address(handle)
 	return tonumber("0x" .. string.sub(handle , 2))
 end
@@ -38,6 +64,7 @@ function command.KILL(_, handle)
 	skynet.kill(handle)
 	local ret = { [skynet.address(handle)] = tostring(services[handle]) }
 	services[handle] = nil
+	remove_standby(handle)
 	return ret
 end
 
@@ -63,6 +90,7 @@ end
 
 function command.REMOVE(_, handle, kill)
 	services[handle] = nil
+	remove_standby(handle)
 	local response = instance[handle]
 	if response then
 		-- instance is dead
@@ -74,10 +102,40 @@ function command.REMOVE(_, handle, kill)
 	return NORET
 end
 
-local function launch_service(service, ...)
+function fill_pool()
+	if filling then
+		return
+	end
+	filling = true
+	skynet.fork(function()
+		while #pool + npending < pool_size do
+			local inst = skynet.launch("snlua", STANDBY)
+			if not inst then
+				break
+			end
+			pending[inst] = true
+			npending = npending + 1
+			-- let the requests in queue go first
+			skynet.yield()
+		end
+		filling = false
+	end)
+end
+
+local function standby_service(service, param)
+	if service ~= "snlua" or #pool == 0 then
+		return
+	end
+	local inst = table.remove(pool)
+	-- the first text message of standby service is the parameter of launch
+	skynet.rawsend(inst, "text", param)
+	fill_pool()
+	return inst
+end
+
+local function launch_service(response, service, ...)
 	local param = table.concat({...}, " ")
-	local inst = skynet.launch(service, param)
-	local response = skynet.response()
+	local inst = standby_service(service, param) or skynet.launch(service, param)
 	if inst then
 		services[inst] = service .. " " .. param
 		instance[inst] = response
@@ -89,12 +147,33 @@ local function launch_service(service, ...)
 end
 
 function command.LAUNCH(_, service, ...)
-	launch_service(service, ...)
+	launch_service(skynet.response(), service, ...)
+	return NORET
+end
+
+-- 一次启动 n 个相同的服务，全部初始化完成后返回地址列表，启动失败的位置为 false
+function command.LAUNCHN(_, n, service, ...)
+	local response = skynet.response()
+	local list = {}
+	local count = n
+	if count <= 0 then
+		response(true, list)
+		return NORET
+	end
+	for i = 1, n do
+		launch_service(function(ok, address)
+			list[i] = ok and address or false
+			count = count - 1
+			if count == 0 then
+				response(true, list)
+			end
+		end, service, ...)
+	end
 	return NORET
 end
 
 function command.LOGLAUNCH(_, service, ...)
-	local inst = launch_service(service, ...)
+	local inst = launch_service(skynet.response(), service, ...)
 	if inst then
 		core.command("LOGON", skynet.address(inst))
 	end
@@ -104,6 +183,11 @@ end
 function command.ERROR(address)
 	-- see serivce-src/service_lua.c
 	-- init failed
+	if pending[address] then
+		pending[address] = nil
+		npending = npending - 1
+		return NORET
+	end
 	local response = instance[address]
 	if response then
 		response(false)
@@ -114,6 +198,12 @@ function command.ERROR(address)
 end
 
 function command.LAUNCHOK(address)
+	if pending[address] then
+		pending[address] = nil
+		npending = npending - 1
+		table.insert(pool, address)
+		return NORET
+	end
 	-- init notice
 	local response = instance[address]
 	if response then
@@ -154,4 +244,4 @@ skynet.dispatch("lua", function(session, address, cmd , ...)
 	end
 end)
 
-skynet.start(function() end)
+skynet.start(fill_pool)
@@ -33,8 +33,13 @@ struct skynet_context;
 void skynet_error(struct skynet_context * context, const char *msg, ...);
 const char * skynet_command(struct skynet_context * context, const char * cmd , const char * parm);
 uint32_t skynet_queryname(struct skynet_context * context, const char * name);
+// skynet_send returns the session, -1 for invalid destination,
+// or SKYNET_SATURATED when the destination is above its high watermark (see WATERMARK command)
+#define SKYNET_SATURATED (-2)
 int skynet_send(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int session, void * msg, size_t sz);
 int skynet_sendname(struct skynet_context * context, uint32_t source, const char * destination , int type, int session, void * msg, size_t sz);
+// send n messages (session 0) to one destination, return 0 for success, -1 for invalid destination or SKYNET_SATURATED
+int skynet_send_batch(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int n, void * msg[], size_t sz[]);
 
 int skynet_isremote(struct skynet_context *, uint32_t handle, int * harbor);
 
@@ -3,18 +3,59 @@
 #include "skynet_handle.h"
 #include "skynet_server.h"
 #include "rwlock.h"
+#include "atomic.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 
 #define DEFAULT_SLOT_SIZE 4
 #define MAX_SLOT_SIZE 0x40000000
+#define READER_SLOT 64
+#define CACHE_LINE 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() __sync_synchronize()
+#endif
+
+// skynet_handle_grab doesn't take the lock. A reader announces itself in its own
+// reader slot (one cache line per thread), counted in the half of the current epoch,
+// then loads the slot array and grabs the context.
+// The writers (register/retire) are still serialized by the lock; after unlinking a
+// context or replacing the slot array, they flip the epoch (outside the lock) and wait
+// for the readers counted in the old epoch, then nobody can still hold the old pointer
+// without a reference. The readers which start after the flip are counted in the other
+// half, so they can't starve the writer even when threads share a reader slot.
+//
+// It isn't a single plain load: announcing costs an atomic increment and decrement of
+// the reader slot. The slot is private to the thread while there are no more than
+// READER_SLOT threads, so these don't contend, but they are still locked instructions.
+
+//服务槽数组，扩容时发布一个新的数组
+struct handle_slot {
+	int size; //槽的大小
+	struct skynet_context * ctx[1]; //context数组，大小为size
+};
+
+//读者槽，每个线程一个（线程数超过READER_SLOT时共享），独占一个cache line
+struct handle_reader {
+	volatile int count[2]; //两个纪元中正在读的线程数
+} __attribute__((aligned(CACHE_LINE)));
 
 //具名服务的名称和地址
 struct handle_name {
 	char * name; //名称
+	uint32_t hash; //名称的哈希值
 	uint32_t handle; //handle
+	struct handle_name * next; //同一个哈希桶中的下一个
 };
 
 //服务地址存储管理
@@ -23,16 +64,75 @@ struct handle_storage {
 
 	uint32_t harbor; //harbor地址
 	uint32_t handle_index; //未分配的下一个服务地址，服务地址从1开始
-	int slot_size; //槽的大小
-	struct skynet_context ** slot; //context数组，大小为slot_size
+	struct handle_slot * volatile slot; //当前的槽数组
+	int reader_index; //已分配的读者槽数量
+	pthread_key_t reader_key; //线程的读者槽编号+1
+	volatile int epoch; //当前纪元，读者计入count[epoch & 1]
+	pthread_mutex_t sync; //写者等待读者时持有，一次只翻转一个纪元
+	struct handle_reader *reader; //READER_SLOT个读者槽，按cache line对齐
 	
-	int name_cap;   //存储具名服务数组的大小，不够扩容，默认大小为2，每次增大一倍，最大为MAX_SLOT_SIZE
+	int name_cap;   //具名服务哈希桶的数量，数量超过后扩容，默认大小为2，每次增大一倍，最大为MAX_SLOT_SIZE
 	int name_count; //具名服务的数量
-	struct handle_name *name; //保存具名服务，大小为name_cap
+	uint32_t name_version; //名称映射改变时加1，用于使服务缓存的地址失效
+	struct handle_name **name; //具名服务的哈希桶，大小为name_cap
 };
 
 static struct handle_storage *H = NULL;
 
+static struct handle_slot *
+slot_new(int size) {
+	struct handle_slot *slot = skynet_malloc(sizeof(*slot) + (size-1) * sizeof(struct skynet_context *));
+	slot->size = size;
+	memset(slot->ctx, 0, size * sizeof(struct skynet_context *));
+	return slot;
+}
+
+//当前线程的读者槽，第一次使用时分配
+static inline struct handle_reader *
+reader_slot(struct handle_storage *s) {
+	int id = (int)(intptr_t)pthread_getspecific(s->reader_key);
+	if (id == 0) {
+		id = ATOM_FINC(&s->reader_index) % READER_SLOT + 1;
+		pthread_setspecific(s->reader_key, (void *)(intptr_t)id);
+	}
+	return &s->reader[id-1];
+}
+
+//读者进入，返回计入的纪元
+static inline int
+reader_enter(struct handle_storage *s, struct handle_reader *r) {
+	int e = s->epoch & 1;
+	ATOM_INC(&r->count[e]);
+	return e;
+}
+
+static inline void
+reader_leave(struct handle_reader *r, int e) {
+	ATOM_DEC(&r->count[e]);
+}
+
+//等待所有在此之前开始的读者结束
+//翻转纪元后只等计入旧纪元的读者，之后开始的读者只能看到新的槽数组
+static void
+reader_sync(struct handle_storage *s) {
+	int i;
+	pthread_mutex_lock(&s->sync);
+	int e = s->epoch & 1;
+	ATOM_INC(&s->epoch);
+	for (i=0;i<READER_SLOT;i++) {
+		int spin = 0;
+		while (s->reader[i].count[e]) {
+			if (++spin < 64) {
+				cpu_relax();
+			} else {
+				sched_yield();
+			}
+		}
+	}
+	__sync_synchronize();
+	pthread_mutex_unlock(&s->sync);
+}
+
 //分配服务地址
 //如果数组大小不够，扩容
 //返回服务地址，该地址包涵harbor地址
@@ -40,36 +140,46 @@ uint32_t
 skynet_handle_register(struct skynet_context *ctx) {
 	struct handle_storage *s = H;
 
+	struct handle_slot *old = NULL; //扩容替换下来的数组
+
 	rwlock_wlock(&s->lock);
 	
 	for (;;) {
+		struct handle_slot *slot = s->slot;
 		int i;
-		for (i=0;i<s->slot_size;i++) {
+		for (i=0;i<slot->size;i++) {
 			uint32_t handle = (i+s->handle_index) & HANDLE_MASK; //本地地址
-			int hash = handle & (s->slot_size-1); //哈希
-			if (s->slot[hash] == NULL) {
-				s->slot[hash] = ctx;
+			int hash = handle & (slot->size-1); //哈希
+			if (slot->ctx[hash] == NULL) {
+				slot->ctx[hash] = ctx;
 				s->handle_index = handle + 1;
 
 				rwlock_wunlock(&s->lock);
 
+				if (old) {
+					// wait for the readers of the old array outside the lock, don't stall other writers
+					reader_sync(s);
+					skynet_free(old);
+				}
+
 				handle |= s->harbor; //将harbor地址和本地地址相连
 				return handle;
 			}
 		}
 
-		//存储数组满了，扩容
-		assert((s->slot_size*2 - 1) <= HANDLE_MASK);
-		struct skynet_context ** new_slot = skynet_malloc(s->slot_size * 2 * sizeof(struct skynet_context *));
-		memset(new_slot, 0, s->slot_size * 2 * sizeof(struct skynet_context *));
-		for (i=0;i<s->slot_size;i++) {
-			int hash = skynet_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
-			assert(new_slot[hash] == NULL);
-			new_slot[hash] = s->slot[i];
+		//存储数组满了，扩容：复制到新的数组并发布，等旧数组的读者都结束后再释放
+		//扩容后的数组一定有空位，所以一次注册最多扩容一次
+		assert(old == NULL);
+		assert((slot->size*2 - 1) <= HANDLE_MASK);
+		struct handle_slot *new_slot = slot_new(slot->size * 2);
+		for (i=0;i<slot->size;i++) {
+			int hash = skynet_context_handle(slot->ctx[i]) & (new_slot->size - 1);
+			assert(new_slot->ctx[hash] == NULL);
+			new_slot->ctx[hash] = slot->ctx[i];
 		}
-		skynet_free(s->slot);
+		__sync_synchronize();
 		s->slot = new_slot;
-		s->slot_size *= 2;
+		old = slot;
 	}
 }
 
@@ -81,25 +191,33 @@ skynet_handle_retire(uint32_t handle) {
 
 	rwlock_wlock(&s->lock);
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
+	struct handle_slot *slot = s->slot;
+	uint32_t hash = handle & (slot->size-1);
+	struct skynet_context * ctx = slot->ctx[hash];
 
 	if (ctx != NULL && skynet_context_handle(ctx) == handle) {
-		s->slot[hash] = NULL;
+		slot->ctx[hash] = NULL;
 		ret = 1;
-		//释放handle,并重排name数组（后边的向前移位）
-		int i; 
-		int j=0, n=s->name_count;
-		for (i=0; i<n; ++i) {
-			if (s->name[i].handle == handle) {
-				skynet_free(s->name[i].name);
-				continue;
-			} else if (i!=j) {
-				s->name[j] = s->name[i];
+		//释放handle,并把它的名称从哈希桶中摘除
+		int i;
+		int old_count = s->name_count;
+		for (i=0; i<s->name_cap && s->name_count > 0; ++i) {
+			struct handle_name **pn = &s->name[i];
+			while (*pn) {
+				struct handle_name *n = *pn;
+				if (n->handle == handle) {
+					*pn = n->next;
+					skynet_free(n->name);
+					skynet_free(n);
+					--s->name_count;
+				} else {
+					pn = &n->next;
+				}
 			}
-			++j;
 		}
-		s->name_count = j;
+		if (old_count != s->name_count) {
+			skynet_handle_namechanged();
+		}
 	} else {
 		ctx = NULL;
 	}
@@ -108,6 +226,8 @@ skynet_handle_retire(uint32_t handle) {
 
 	//释放服务
 	if (ctx) {
+		// a reader may have loaded ctx before it's unlinked, wait for it grabbing ctx.
+		reader_sync(s);
 		// release ctx may call skynet_handle_* , so wunlock first.
 		skynet_context_release(ctx);
 	}
@@ -121,13 +241,15 @@ skynet_handle_retireall() {
 	for (;;) {
 		int n=0;
 		int i;
-		for (i=0;i<s->slot_size;i++) {
-			rwlock_rlock(&s->lock);
-			struct skynet_context * ctx = s->slot[i];
+		for (i=0;i<s->slot->size;i++) {
+			struct handle_reader *r = reader_slot(s);
+			int e = reader_enter(s, r);
+			struct handle_slot *slot = s->slot;
+			struct skynet_context * ctx = i < slot->size ? slot->ctx[i] : NULL;
 			uint32_t handle = 0;
 			if (ctx)
 				handle = skynet_context_handle(ctx);
-			rwlock_runlock(&s->lock);
+			reader_leave(r, e);
 			if (handle != 0) {
 				if (skynet_handle_retire(handle)) {
 					++n;
@@ -139,51 +261,63 @@ skynet_handle_retireall() {
 	}
 }
 
-//通过服务地址找到对应的context结构
+//通过服务地址找到对应的context结构，不加锁
 struct skynet_context * 
 skynet_handle_grab(uint32_t handle) {
 	struct handle_storage *s = H;
 	struct skynet_context * result = NULL;
+	struct handle_reader *r = reader_slot(s);
 
-	rwlock_rlock(&s->lock);
+	int e = reader_enter(s, r);
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
+	struct handle_slot *slot = s->slot;
+	uint32_t hash = handle & (slot->size-1);
+	struct skynet_context * ctx = slot->ctx[hash];
 	if (ctx && skynet_context_handle(ctx) == handle) {
 		result = ctx;
 		skynet_context_grab(result); //引用计数加1
 	}
 
-	rwlock_runlock(&s->lock);
+	reader_leave(r, e);
 
 	return result;
 }
 
+//名称的哈希值
+static inline uint32_t
+name_hash(const char * name) {
+	uint32_t h = 2166136261u;
+	const uint8_t * p = (const uint8_t *)name;
+	while (*p) {
+		h = (h ^ *p++) * 16777619u;
+	}
+	return h;
+}
+
+static struct handle_name *
+_find_name(struct handle_storage *s, const char * name, uint32_t hash) {
+	struct handle_name *n = s->name[hash & (s->name_cap-1)];
+	while (n) {
+		if (n->hash == hash && strcmp(n->name, name) == 0) {
+			return n;
+		}
+		n = n->next;
+	}
+	return NULL;
+}
+
 //通过名称找到handle
 uint32_t 
 skynet_handle_findname(const char * name) {
 	struct handle_storage *s = H;
+	uint32_t hash = name_hash(name);
 
 	rwlock_rlock(&s->lock);
 
 	uint32_t handle = 0;
-
-	//因为名称是按顺序存储的，二分查找
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			handle = n->handle;
-			break;
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
+	struct handle_name *n = _find_name(s, name, hash);
+	if (n) {
+		handle = n->handle;
 	}
 
 	rwlock_runlock(&s->lock);
@@ -191,56 +325,61 @@ skynet_handle_findname(const char * name) {
 	return handle;
 }
 
-//将name和handle组织插入s->name中，按name名称的顺序存储，数组大小不够的申请空间
+//名称映射的版本，缓存的名称地址只在版本不变时有效
+uint32_t
+skynet_handle_nameversion() {
+	return H->name_version;
+}
+
+//名称映射改变了（本地名称随服务退出而删除，或者全局名称指向了新的地址）
+void
+skynet_handle_namechanged() {
+	ATOM_INC(&H->name_version);
+}
+
+//哈希桶数量加倍
 static void
-_insert_name_before(struct handle_storage *s, char *name, uint32_t handle, int before) {
-	if (s->name_count >= s->name_cap) {
-		s->name_cap *= 2;
-		assert(s->name_cap <= MAX_SLOT_SIZE);
-		struct handle_name * n = skynet_malloc(s->name_cap * sizeof(struct handle_name));
-		int i;
-		for (i=0;i<before;i++) {
-			n[i] = s->name[i];
-		}
-		for (i=before;i<s->name_count;i++) {
-			n[i+1] = s->name[i];
-		}
-		skynet_free(s->name);
-		s->name = n;
-	} else {
-		int i;
-		for (i=s->name_count;i>before;i--) {
-			s->name[i] = s->name[i-1];
+_expand_name(struct handle_storage *s) {
+	int cap = s->name_cap * 2;
+	assert(cap <= MAX_SLOT_SIZE);
+	struct handle_name ** bucket = skynet_malloc(cap * sizeof(struct handle_name *));
+	memset(bucket, 0, cap * sizeof(struct handle_name *));
+	int i;
+	for (i=0;i<s->name_cap;i++) {
+		struct handle_name *n = s->name[i];
+		while (n) {
+			struct handle_name *next = n->next;
+			struct handle_name **b = &bucket[n->hash & (cap-1)];
+			n->next = *b;
+			*b = n;
+			n = next;
 		}
 	}
-	s->name[before].name = name;
-	s->name[before].handle = handle;
-	s->name_count ++;
+	skynet_free(s->name);
+	s->name = bucket;
+	s->name_cap = cap;
 }
 
-//找到该名称在name中的位置
+//插入名称，名称已存在返回NULL
 static const char *
 _insert_name(struct handle_storage *s, const char * name, uint32_t handle) {
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			return NULL;
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
+	uint32_t hash = name_hash(name);
+	if (_find_name(s, name, hash)) {
+		return NULL;
 	}
-	char * result = skynet_strdup(name);
-
-	_insert_name_before(s, result, handle, begin);
+	if (s->name_count >= s->name_cap) {
+		_expand_name(s);
+	}
+	struct handle_name *n = skynet_malloc(sizeof(*n));
+	n->name = skynet_strdup(name);
+	n->hash = hash;
+	n->handle = handle;
+	struct handle_name **b = &s->name[hash & (s->name_cap-1)];
+	n->next = *b;
+	*b = n;
+	s->name_count ++;
 
-	return result;
+	return n->name;
 }
 
 //将handle服务地址和名称挂钩
@@ -262,9 +401,18 @@ void
 skynet_handle_init(int harbor) {
 	assert(H==NULL);
 	struct handle_storage * s = skynet_malloc(sizeof(*H));
-	s->slot_size = DEFAULT_SLOT_SIZE; //初始大小为4
-	s->slot = skynet_malloc(s->slot_size * sizeof(struct skynet_context *)); //分配内存
-	memset(s->slot, 0, s->slot_size * sizeof(struct skynet_context *)); //初始化
+	s->slot = slot_new(DEFAULT_SLOT_SIZE); //初始大小为4
+	s->reader_index = 0;
+	s->epoch = 0;
+	pthread_mutex_init(&s->sync, NULL);
+	// skynet_malloc doesn't align to a cache line, align the reader slots by hand (never freed)
+	char *reader = skynet_malloc(READER_SLOT * sizeof(struct handle_reader) + CACHE_LINE - 1);
+	s->reader = (struct handle_reader *)(((uintptr_t)reader + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1));
+	memset(s->reader, 0, READER_SLOT * sizeof(struct handle_reader));
+	if (pthread_key_create(&s->reader_key, NULL)) {
+		fprintf(stderr, "pthread_key_create failed\n");
+		exit(1);
+	}
 
 	rwlock_init(&s->lock);
 	// reserve 0 for system
@@ -272,7 +420,9 @@ skynet_handle_init(int harbor) {
 	s->handle_index = 1;
 	s->name_cap = 2;
 	s->name_count = 0;
-	s->name = skynet_malloc(s->name_cap * sizeof(struct handle_name));
+	s->name_version = 0;
+	s->name = skynet_malloc(s->name_cap * sizeof(struct handle_name *));
+	memset(s->name, 0, s->name_cap * sizeof(struct handle_name *));
 
 	H = s;
 
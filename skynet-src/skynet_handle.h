@@ -17,6 +17,8 @@ void skynet_handle_retireall();
 
 uint32_t skynet_handle_findname(const char * name);
 const char * skynet_handle_namehandle(uint32_t handle, const char *name);
+uint32_t skynet_handle_nameversion(void);	// changes when a name is unbound or rebound
+void skynet_handle_namechanged(void);
 
 void skynet_handle_init(int harbor);
 
@@ -3,14 +3,59 @@
 #include "skynet_server.h"
 #include "skynet_mq.h"
 #include "skynet_handle.h"
+#include "rwlock.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
 
+#define REMOTE_NAME_SIZE 256
+
 static struct skynet_context * REMOTE = 0;
 static unsigned int HARBOR = ~0; //0xffffffff
 
+//harbor服务已知的全局名称地址，按哈希直接映射，冲突时覆盖
+static struct remote_name REMOTE_NAME[REMOTE_NAME_SIZE];
+static struct rwlock NAME_LOCK;
+
+static inline uint32_t
+name_hash(const char name[GLOBALNAME_LENGTH]) {
+	uint32_t h = 2166136261u;
+	int i;
+	for (i=0;i<GLOBALNAME_LENGTH;i++) {
+		h = (h ^ (uint8_t)name[i]) * 16777619u;
+	}
+	return h % REMOTE_NAME_SIZE;
+}
+
+//harbor服务得知全局名称的地址后调用，发送方之后就可以直接用地址发送
+void
+skynet_harbor_setname(const char name[GLOBALNAME_LENGTH], uint32_t handle) {
+	struct remote_name *rn = &REMOTE_NAME[name_hash(name)];
+	rwlock_wlock(&NAME_LOCK);
+	//槽里原来的名称可能已被服务缓存：名称被重新绑定，或者被冲突的名称挤出（之后它再绑定时无从比较），都让缓存失效
+	int changed = rn->handle != 0 && (rn->handle != handle || memcmp(rn->name, name, GLOBALNAME_LENGTH) != 0);
+	memcpy(rn->name, name, GLOBALNAME_LENGTH);
+	rn->handle = handle;
+	rwlock_wunlock(&NAME_LOCK);
+	if (changed) {
+		skynet_handle_namechanged();
+	}
+}
+
+//查询已知的全局名称地址，未知返回0
+uint32_t
+skynet_harbor_findname(const char name[GLOBALNAME_LENGTH]) {
+	struct remote_name *rn = &REMOTE_NAME[name_hash(name)];
+	uint32_t handle = 0;
+	rwlock_rlock(&NAME_LOCK);
+	if (memcmp(rn->name, name, GLOBALNAME_LENGTH) == 0) {
+		handle = rn->handle;
+	}
+	rwlock_runlock(&NAME_LOCK);
+	return handle;
+}
+
 void 
 skynet_harbor_send(struct remote_message *rmsg, uint32_t source, int session) {
 	int type = rmsg->sz >> MESSAGE_TYPE_SHIFT;
@@ -31,6 +76,7 @@ skynet_harbor_message_isremote(uint32_t handle) {
 void
 skynet_harbor_init(int harbor) {
 	HARBOR = (unsigned int)harbor << HANDLE_REMOTE_SHIFT;
+	rwlock_init(&NAME_LOCK);
 }
 
 void
@@ -20,6 +20,8 @@ struct remote_message {
 
 void skynet_harbor_send(struct remote_message *rmsg, uint32_t source, int session);
 int skynet_harbor_message_isremote(uint32_t handle);
+void skynet_harbor_setname(const char name[GLOBALNAME_LENGTH], uint32_t handle);
+uint32_t skynet_harbor_findname(const char name[GLOBALNAME_LENGTH]);	// return 0 when the handle isn't known yet
 void skynet_harbor_init(int harbor);
 void skynet_harbor_start(void * ctx);
 void skynet_harbor_exit();
@@ -6,11 +6,22 @@ struct skynet_config {
 	int thread;
 	int harbor;
 	int profile;
+	int worksteal;
+	int numa;
+	int handoff;
+	int strict_priority;
+	int quantum;
+	int timer_resolution;
+	int socket_thread;
+	int socket_direct_write;
 	const char * daemon;
 	const char * module_path;
 	const char * bootstrap;
 	const char * logger;
 	const char * logservice;
+	const char * worker_cpu;
+	const char * socket_cpu;
+	const char * timer_cpu;
 };
 
 #define THREAD_WORKER 0 //工作线程
@@ -156,6 +156,17 @@ main(int argc, char *argv[]) {
 	config.logger = optstring("logger", NULL);
 	config.logservice = optstring("logservice", "logger");
 	config.profile = optboolean("profile", 1);
+	config.quantum = optint("quantum", 0);
+	config.timer_resolution = optint("timer_resolution", 100);
+	config.socket_thread = optint("socket_thread", 1);
+	config.socket_direct_write = optboolean("socket_direct_write", 0);
+	config.worksteal = optboolean("worksteal", 0);
+	config.numa = optboolean("numa", 0);
+	config.handoff = optboolean("handoff", 0);
+	config.strict_priority = strcmp(optstring("priority_policy", "weighted"), "strict") == 0;
+	config.worker_cpu = optstring("worker_cpu", NULL);
+	config.socket_cpu = optstring("socket_cpu", NULL);
+	config.timer_cpu = optstring("timer_cpu", NULL);
 
 	lua_close(L);
 
@@ -2,14 +2,17 @@
 #include "skynet_mq.h"
 #include "skynet_handle.h"
 #include "spinlock.h"
+#include "atomic.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #define DEFAULT_QUEUE_SIZE 64
+#define MAX_SEGMENT_SIZE 0x10000
 #define MAX_GLOBAL_MQ 0x10000
 
 // 0 means mq is not in global mq.
@@ -17,78 +20,384 @@
 
 #define MQ_IN_GLOBAL 1
 #define MQ_OVERLOAD 1024
+#define HANDOFF_LIMIT 16
+
+// The message queue is a lock-free multi-producer/single-consumer queue.
+// Messages are stored in a linked list of segments. Producers reserve a slot
+// with an atomic increment of the segment's write index and then publish it by
+// setting the slot's ready flag. Only the consumer (the worker owning the queue
+// via in_global) reads from the head. When a segment is full, the producer who
+// reserved the slot just past the end links a new one, so the queue grows
+// without copying the pending messages.
+
+//消息段，多个段组成一个链表
+struct mq_segment {
+	struct mq_segment * volatile next; //下一个段
+	uint32_t base; //段中第一个消息的全局序号，用于计算队列长度
+	int cap; //段的大小
+	int write; //生产者已预留的位置数，可能超过cap
+	struct skynet_message *queue; //消息数组
+	volatile char *ready; //标记位置是否已写入完成
+};
 
 //消息队列结构
 struct message_queue {
-	struct spinlock lock; //自旋锁
 	uint32_t handle; //服务地址
-	int cap; //队列的大小 默认64
-	int head; //第一个消息 index
-	int tail; //最后一个消息 index
 	int release; //标记是否释放 1 表示释放
 	int in_global; //是否在全局消息队列中
 	int overload; //消息过载
 	int overload_threshold; //过载极限
-	struct skynet_message *queue; //消息数组
+	int producers; //正在写入的生产者数量，为0时才能释放已消费的段
+	int node; //NUMA模式下服务所在的节点，-1表示还未确定
+	int priority; //调度优先级 MQ_PRIORITY_*
+	int high; //高水位，队列长度达到后拒绝(或丢弃)新消息，0表示不限制
+	int low; //低水位，饱和后长度降到此值以下才恢复
+	int policy; //饱和时的处理方式 MQ_WATERMARK_*
+	volatile int saturated; //是否饱和，生产者和消费者都会修改，用ATOM_CAS
+	volatile int paused; //饱和时是否有生产者(socket线程)暂停了写入，需要在恢复时通知
+	struct mq_segment * volatile tail; //生产者写入的段
+	struct mq_segment * volatile head; //消费者读取的段
+	int head_index; //消费者在head段中的位置
+	struct mq_segment *retired; //已消费完，等待释放的段
+	struct mq_segment * volatile spare; //备用段，避免频繁分配
 	struct message_queue *next; //下一个消息队列
 };
 
-//全局消息结构
+//全局消息结构，每个优先级一个链表
 struct global_queue {
-	struct message_queue *head; //指向第一个消息队列
-	struct message_queue *tail; //指向最后一个消息队列
+	struct message_queue *head[MQ_PRIORITY_COUNT]; //指向第一个消息队列
+	struct message_queue *tail[MQ_PRIORITY_COUNT]; //指向最后一个消息队列
+	int length[MQ_PRIORITY_COUNT]; //每个优先级链表中消息队列的数量
+	int total; //所有优先级的消息队列数量
+	unsigned turn; //加权轮询的位置
 	struct spinlock lock; //自旋锁
 };
 
+// weighted policy : high 4 , normal 2 , low 1
+static const int WEIGHTED_TURN[] = {
+	MQ_PRIORITY_HIGH, MQ_PRIORITY_NORMAL, MQ_PRIORITY_HIGH, MQ_PRIORITY_LOW,
+	MQ_PRIORITY_HIGH, MQ_PRIORITY_NORMAL, MQ_PRIORITY_HIGH,
+};
+
+static int STRICT_PRIORITY = 0; //1为严格优先级，否则为加权轮询
+
 //全局消息队列
 static struct global_queue *Q = NULL;
 
-//将服务的消息队列，压入全局队列
-void 
-skynet_globalmq_push(struct message_queue * queue) {
-	struct global_queue *q= Q;
+//work stealing 模式下，每个工作线程私有的消息队列链表
+//LQ 为 NULL 时是单一全局队列模式（默认）
+static struct global_queue *LQ = NULL;
+static int LQ_COUNT = 0;
+static pthread_key_t LQ_KEY; //工作线程的编号+1，非工作线程为0
+
+//NUMA模式下，每个节点一个队列，存放属于该节点但由其他节点的线程压入的消息队列
+//NQ 为 NULL 时不区分节点
+static struct global_queue *NQ = NULL;
+static int NQ_COUNT = 0;
+static int *LQ_NODE = NULL; //每个工作线程所在的节点
+
+//直接交接模式下，每个工作线程下一个直接调度的消息队列
+//RUNNEXT 为 NULL 时不开启
+struct handoff {
+	struct message_queue *q;
+	int streak; //连续直接调度的次数，避免两个服务一直占用一个工作线程
+};
+
+static struct handoff *RUNNEXT = NULL;
 
+static void
+gq_push(struct global_queue *q, struct message_queue * queue) {
+	int p = queue->priority;
 	SPIN_LOCK(q)
 	assert(queue->next == NULL);
-	if(q->tail) {
-		q->tail->next = queue;
-		q->tail = queue;
+	if(q->tail[p]) {
+		q->tail[p]->next = queue;
+		q->tail[p] = queue;
 	} else {
-		q->head = q->tail = queue; //第一个
+		q->head[p] = q->tail[p] = queue; //第一个
 	}
+	++q->length[p];
+	++q->total;
 	SPIN_UNLOCK(q)
 }
 
-//服务的消息队列，出全局队列
-struct message_queue * 
-skynet_globalmq_pop() {
-	struct global_queue *q = Q;
-
+static struct message_queue *
+gq_pop(struct global_queue *q) {
+	if (q->total == 0) {
+		// don't touch the lock of an empty queue, it's the common case when stealing
+		return NULL;
+	}
 	SPIN_LOCK(q)
-	struct message_queue *mq = q->head;
+	//按策略选择优先级，该优先级为空时选择最高的非空优先级
+	int p = MQ_PRIORITY_HIGH;
+	if (!STRICT_PRIORITY) {
+		p = WEIGHTED_TURN[q->turn++ % (sizeof(WEIGHTED_TURN)/sizeof(WEIGHTED_TURN[0]))];
+	}
+	if (q->head[p] == NULL) {
+		for (p=0;p<MQ_PRIORITY_COUNT-1;p++) {
+			if (q->head[p])
+				break;
+		}
+	}
+	struct message_queue *mq = q->head[p];
 	if(mq) {
-		q->head = mq->next; //指向下一个
-		if(q->head == NULL) { //最后一个消息队列
-			assert(mq == q->tail);
-			q->tail = NULL;
+		q->head[p] = mq->next; //指向下一个
+		if(q->head[p] == NULL) { //最后一个消息队列
+			assert(mq == q->tail[p]);
+			q->tail[p] = NULL;
 		}
 		mq->next = NULL;
+		--q->length[p];
+		--q->total;
 	}
 	SPIN_UNLOCK(q)
 
 	return mq;
 }
 
+//创建记录工作线程编号的key，work stealing 和直接交接模式共用
+static void
+worker_key_init(int worker) {
+	if (LQ_COUNT == 0) {
+		if (pthread_key_create(&LQ_KEY, NULL)) {
+			fprintf(stderr, "pthread_key_create failed\n");
+			exit(1);
+		}
+		LQ_COUNT = worker;
+	}
+	assert(worker == LQ_COUNT);
+}
+
+//当前线程的工作线程编号+1，非工作线程返回0
+static inline int
+worker_id() {
+	return (int)(intptr_t)pthread_getspecific(LQ_KEY);
+}
+
+//当前线程所属的工作线程队列，非工作线程返回NULL
+static inline struct global_queue *
+local_queue() {
+	int id = worker_id();
+	if (id == 0) {
+		return NULL;
+	}
+	return &LQ[id-1];
+}
+
+//将服务的消息队列，压入全局队列
+//work stealing 模式下，工作线程压入自己的队列，其他线程(socket timer等)压入全局队列
+//NUMA模式下，已确定节点的消息队列只压入本节点的工作线程队列或节点队列
+void 
+skynet_globalmq_push(struct message_queue * queue) {
+	if (LQ) {
+		struct global_queue *lq = local_queue();
+		if (NQ && queue->node >= 0 && (lq == NULL || LQ_NODE[lq - LQ] != queue->node)) {
+			gq_push(&NQ[queue->node], queue);
+			return;
+		}
+		if (lq) {
+			gq_push(lq, queue);
+			return;
+		}
+	}
+	gq_push(Q, queue);
+}
+
+//work stealing 模式下，依次尝试：自己的队列，(本节点队列)，全局队列，其他工作线程的队列
+//NUMA模式下只从同一节点的工作线程中窃取
+static struct message_queue *
+local_pop(int id) {
+	struct message_queue *mq = gq_pop(&LQ[id]);
+	if (mq) {
+		return mq;
+	}
+	if (NQ) {
+		mq = gq_pop(&NQ[LQ_NODE[id]]);
+		if (mq) {
+			return mq;
+		}
+	}
+	mq = gq_pop(Q);
+	if (mq) {
+		return mq;
+	}
+	int i;
+	for (i=1;i<LQ_COUNT;i++) {
+		int victim = (id + i) % LQ_COUNT;
+		if (NQ && LQ_NODE[victim] != LQ_NODE[id]) {
+			continue;
+		}
+		mq = gq_pop(&LQ[victim]);
+		if (mq) {
+			return mq;
+		}
+	}
+	return NULL;
+}
+
+//服务的消息队列，出全局队列
+//NUMA模式下，第一次被调度的消息队列(不管从哪里取出)绑定到当前节点
+struct message_queue * 
+skynet_globalmq_pop() {
+	struct global_queue *lq;
+	if (LQ == NULL || (lq = local_queue()) == NULL) {
+		return gq_pop(Q);
+	}
+	int id = lq - LQ;
+	struct message_queue *mq = local_pop(id);
+	if (mq && NQ && mq->node < 0) {
+		mq->node = LQ_NODE[id];
+	}
+	return mq;
+}
+
+//节点上的工作线程能否取到等待调度的消息队列，不是NUMA模式时总是检查全局队列
+int
+skynet_globalmq_pending(int node) {
+	if (Q->total > 0) {
+		return 1;
+	}
+	if (NQ == NULL) {
+		return 0;
+	}
+	if (NQ[node].total > 0) {
+		return 1;
+	}
+	int i;
+	for (i=0;i<LQ_COUNT;i++) {
+		if (LQ_NODE[i] == node && LQ[i].total > 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//开启NUMA模式，node[i]为第i个工作线程所在的节点，需要先以work stealing模式初始化
+void
+skynet_mq_numa(int worker, const int *node) {
+	assert(LQ && worker == LQ_COUNT);
+	int i;
+	int n = 0;
+	LQ_NODE = skynet_malloc(worker * sizeof(int));
+	for (i=0;i<worker;i++) {
+		LQ_NODE[i] = node[i];
+		if (node[i] >= n) {
+			n = node[i] + 1;
+		}
+	}
+	struct global_queue *nq = skynet_malloc(n * sizeof(*nq));
+	memset(nq, 0, n * sizeof(*nq));
+	for (i=0;i<n;i++) {
+		SPIN_INIT(&nq[i]);
+	}
+	NQ_COUNT = n;
+	NQ = nq;
+}
+
+//取出当前工作线程下一个直接调度的消息队列，没有返回NULL
+//连续直接调度超过HANDOFF_LIMIT次时，放回全局队列，让其他服务有机会被调度
+struct message_queue *
+skynet_globalmq_runnext() {
+	int id;
+	if (RUNNEXT == NULL || (id = worker_id()) == 0) {
+		return NULL;
+	}
+	struct handoff *h = &RUNNEXT[id-1];
+	struct message_queue *q = h->q;
+	if (q == NULL) {
+		h->streak = 0;
+		return NULL;
+	}
+	h->q = NULL;
+	if (++h->streak > HANDOFF_LIMIT) {
+		h->streak = 0;
+		skynet_globalmq_push(q);
+		return NULL;
+	}
+	return q;
+}
+
+//开启直接交接模式
+void
+skynet_mq_handoff(int worker) {
+	worker_key_init(worker);
+	struct handoff *h = skynet_malloc(worker * sizeof(*h));
+	memset(h, 0, worker * sizeof(*h));
+	RUNNEXT = h;
+}
+
+//把当前线程绑定为第id个工作线程
+void
+skynet_globalmq_bind(int id) {
+	if (LQ || RUNNEXT) {
+		assert(id >= 0 && id < LQ_COUNT);
+		pthread_setspecific(LQ_KEY, (void *)(intptr_t)(id+1));
+	}
+}
+
+//创建一个消息段
+static struct mq_segment *
+segment_new(int cap, uint32_t base) {
+	struct mq_segment *s = skynet_malloc(sizeof(*s) + cap * (sizeof(struct skynet_message) + 1));
+	s->next = NULL;
+	s->base = base;
+	s->cap = cap;
+	s->write = 0;
+	s->queue = (struct skynet_message *)(s+1);
+	s->ready = (char *)(s->queue + cap);
+	memset((void *)s->ready, 0, cap);
+	return s;
+}
+
+//生产者为已满的段s分配下一个段
+//消费者还在s中说明没有积压，使用默认大小(优先用备用段)；否则大小加倍
+static struct mq_segment *
+segment_grow(struct message_queue *q, struct mq_segment *s) {
+	uint32_t base = s->base + s->cap;
+	if (q->head != s) {
+		int cap = s->cap * 2;
+		if (cap > MAX_SEGMENT_SIZE) {
+			cap = MAX_SEGMENT_SIZE;
+		}
+		return segment_new(cap, base);
+	}
+	struct mq_segment *spare = q->spare;
+	if (spare && ATOM_CAS_POINTER(&q->spare, spare, NULL)) {
+		spare->base = base;
+		return spare;
+	}
+	return segment_new(DEFAULT_QUEUE_SIZE, base);
+}
+
+//释放已消费的段，只有没有生产者正在写入时，才能保证没有人还持有这些段
+static void
+segment_collect(struct message_queue *q) {
+	if (q->retired == NULL || q->producers != 0) {
+		return;
+	}
+	struct mq_segment *s = q->retired;
+	q->retired = NULL;
+	while (s) {
+		struct mq_segment *next = s->next;
+		if (s->cap == DEFAULT_QUEUE_SIZE && q->spare == NULL) {
+			s->next = NULL;
+			s->write = 0;
+			memset((void *)s->ready, 0, s->cap);
+			__sync_synchronize();
+			q->spare = s;
+		} else {
+			skynet_free(s);
+		}
+		s = next;
+	}
+}
+
 //创建一个消息队列
 //handle 服务地址
 struct message_queue * 
 skynet_mq_create(uint32_t handle) {
 	struct message_queue *q = skynet_malloc(sizeof(*q));
 	q->handle = handle;
-	q->cap = DEFAULT_QUEUE_SIZE;
-	q->head = 0;
-	q->tail = 0;
-	SPIN_INIT(q)
 	// When the queue is create (always between service create and service init) ,
 	// set in_global flag to avoid push it to global queue .
 	// If the service init success, skynet_context_new will call skynet_mq_push to push it to global queue.
@@ -96,7 +405,18 @@ skynet_mq_create(uint32_t handle) {
 	q->release = 0;
 	q->overload = 0;
 	q->overload_threshold = MQ_OVERLOAD;
-	q->queue = skynet_malloc(sizeof(struct skynet_message) * q->cap); //队列的默认大小
+	q->producers = 0;
+	q->node = -1;
+	q->priority = MQ_PRIORITY_NORMAL;
+	q->high = 0;
+	q->low = 0;
+	q->policy = MQ_WATERMARK_REJECT;
+	q->saturated = 0;
+	q->paused = 0;
+	q->head = q->tail = segment_new(DEFAULT_QUEUE_SIZE, 0); //队列的默认大小
+	q->head_index = 0;
+	q->retired = NULL;
+	q->spare = NULL;
 	q->next = NULL;
 
 	return q;
@@ -106,32 +426,90 @@ skynet_mq_create(uint32_t handle) {
 static void 
 _release(struct message_queue *q) {
 	assert(q->next == NULL);
-	SPIN_DESTROY(q)
-	skynet_free(q->queue);
+	// wait for the producers who may still hold a segment
+	while (q->producers) {
+		__sync_synchronize();
+	}
+	struct mq_segment *s = q->head;
+	while (s) {
+		struct mq_segment *next = s->next;
+		skynet_free(s);
+		s = next;
+	}
+	s = q->retired;
+	while (s) {
+		struct mq_segment *next = s->next;
+		skynet_free(s);
+		s = next;
+	}
+	skynet_free(q->spare);
 	skynet_free(q);
 }
 
+//设置消息队列的调度优先级，下次压入全局队列时生效
+void
+skynet_mq_setpriority(struct message_queue *q, int priority) {
+	assert(priority >= 0 && priority < MQ_PRIORITY_COUNT);
+	q->priority = priority;
+}
+
+int
+skynet_mq_priority(struct message_queue *q) {
+	return q->priority;
+}
+
+//统计各优先级在全局队列中等待调度的消息队列数量
+void
+skynet_globalmq_depth(int depth[MQ_PRIORITY_COUNT]) {
+	int i,j;
+	for (i=0;i<MQ_PRIORITY_COUNT;i++) {
+		depth[i] = Q->length[i];
+		if (LQ) {
+			for (j=0;j<LQ_COUNT;j++) {
+				depth[i] += LQ[j].length[i];
+			}
+		}
+		if (NQ) {
+			for (j=0;j<NQ_COUNT;j++) {
+				depth[i] += NQ[j].length[i];
+			}
+		}
+	}
+}
+
+//设置全局队列的调度策略，strict为1时总是先调度高优先级
+void
+skynet_globalmq_policy(int strict) {
+	STRICT_PRIORITY = strict;
+}
+
 //获得消息队列所在的服务地址
 uint32_t 
 skynet_mq_handle(struct message_queue *q) {
 	return q->handle;
 }
 
+//消息队列中的消息数量，包括生产者已预留还未写完的消息
+static int
+queue_length(struct message_queue *q) {
+	struct mq_segment *tail = q->tail;
+	int write = tail->write;
+	if (write > tail->cap) {
+		write = tail->cap;
+	}
+	uint32_t length = tail->base + write - (q->head->base + q->head_index);
+	if ((int)length < 0) {
+		// tail has been read before head moved
+		return 0;
+	}
+	return (int)length;
+}
+
 //消息队列中的消息数量
+//只能由消费者（正在分发该队列的线程）调用
 int
 skynet_mq_length(struct message_queue *q) {
-	int head, tail,cap;
-
-	SPIN_LOCK(q)
-	head = q->head;
-	tail = q->tail;
-	cap = q->cap;
-	SPIN_UNLOCK(q)
-	
-	if (head <= tail) {
-		return tail - head;
-	}
-	return tail + cap - head;
+	return queue_length(q);
 }
 
 //消息过载多少
@@ -145,114 +523,321 @@ skynet_mq_overload(struct message_queue *q) {
 	return 0;
 }
 
+//段s中位置i(或者s已读完时下一个段的开头)的消息是否已写入完成
+static int
+segment_ready(struct mq_segment *s, int i) {
+	if (i == s->cap) {
+		s = s->next;
+		if (s == NULL) {
+			return 0;
+		}
+		i = 0;
+	}
+	return s->ready[i];
+}
+
+//下一个消息是否已写入完成，不改变队列状态，只能由消费者调用
+static int
+queue_ready(struct message_queue *q) {
+	return segment_ready(q->head, q->head_index);
+}
+
+//取出一个消息，队列为空返回1
+static int
+queue_pop(struct message_queue *q, struct skynet_message *message) {
+	struct mq_segment *s = q->head;
+	int i = q->head_index;
+	if (i == s->cap) {
+		struct mq_segment *next = s->next;
+		if (next == NULL) {
+			return 1;
+		}
+		q->head = next;
+		q->head_index = i = 0;
+		s->next = q->retired;
+		q->retired = s;
+		s = next;
+	}
+	if (!s->ready[i]) {
+		return 1;
+	}
+	__sync_synchronize();
+	*message = s->queue[i];
+	q->head_index = i + 1;
+	return 0;
+}
+
+//队列为空时清除in_global标记，返回1表示已不再拥有该队列
+//返回0表示清除后又有消息写入，重新拥有了该队列
+static int
+queue_idle(struct message_queue *q) {
+	// reset overload_threshold when queue is empty
+	q->overload_threshold = MQ_OVERLOAD; //队列是空，重置
+	segment_collect(q);
+
+	// Take the read position while still owning the queue, another worker may own it and
+	// move head after in_global is cleared. Count self as a producer before that, so the
+	// segment can't be freed (or reused as the spare) while checking it.
+	struct mq_segment *s = q->head;
+	int i = q->head_index;
+	ATOM_INC(&q->producers);
+
+	//消息队列为空，不标记不在全局中
+	q->in_global = 0;
+	__sync_synchronize();
+	// A producer may publish a message before it sees in_global == 0, check again.
+	int ready = segment_ready(s, i);
+	ATOM_DEC(&q->producers);
+	if (!ready || !ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+		return 1;
+	}
+	// own the queue again, but the message may be taken by another worker in the meantime
+	return 0;
+}
+
+//消费者放弃一个空的消息队列，返回1表示已放弃，0表示队列不空（仍然拥有）
+int
+skynet_mq_idle(struct message_queue *q) {
+	while (!queue_ready(q)) {
+		if (queue_idle(q)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 //从消息队列中取出一个消息，存放在参数message
 int
 skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
-	int ret = 1;
-	SPIN_LOCK(q)
+	while (queue_pop(q, message)) {
+		if (queue_idle(q)) {
+			return 1;
+		}
+	}
 
-	if (q->head != q->tail) {
-		*message = q->queue[q->head++];
-		ret = 0;
-		int head = q->head;
-		int tail = q->tail;
-		int cap = q->cap;
+	int length = queue_length(q); //队列中剩余消息数
+	while (length > q->overload_threshold) {
+		q->overload = length;
+		q->overload_threshold *= 2;
+	}
 
-		//队列头超出队列大小，将头指向队列数组的开始
-		if (head >= cap) {
-			q->head = head = 0;
-		}
-		int length = tail - head; //队列中剩余消息数
-		if (length < 0) {
-			length += cap;
-		}
+	return 0;
+}
+
+//批量取出最多max个消息，返回取出的数量，0表示队列为空
+//一次调用只做一次过载检测和in_global检查
+int
+skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *messages, int max) {
+	assert(max > 0);
+	if (skynet_mq_pop(q, &messages[0])) {
+		return 0;
+	}
+	int n = 1;
+	while (n < max && !queue_pop(q, &messages[n])) {
+		++n;
+	}
+	if (n > 1) {
+		int length = queue_length(q);
 		while (length > q->overload_threshold) {
 			q->overload = length;
 			q->overload_threshold *= 2;
 		}
-	} else {
-		// reset overload_threshold when queue is empty
-		q->overload_threshold = MQ_OVERLOAD; //队列是空，重置
 	}
-
-	//消息队列为空，不标记不在全局中
-	if (ret) {
-		q->in_global = 0;
-	}
-	
-	SPIN_UNLOCK(q)
-
-	return ret;
+	return n;
 }
 
-//扩展队列大小，队列大小增加一倍
+//n个消息入队列，不处理in_global
+//一次预留一段连续的位置，跨越段末尾的生产者负责链接新的段
 static void
-expand_queue(struct message_queue *q) {
-	struct skynet_message *new_queue = skynet_malloc(sizeof(struct skynet_message) * q->cap * 2);
-	int i;
-	for (i=0;i<q->cap;i++) {
-		new_queue[i] = q->queue[(q->head + i) % q->cap];
+queue_push(struct message_queue *q, struct skynet_message *messages, int n) {
+	ATOM_INC(&q->producers);
+	while (n > 0) {
+		struct mq_segment *s = q->tail;
+		int i = ATOM_ADD(&s->write, n) - n;
+		int k = 0;
+		if (i < s->cap) {
+			k = s->cap - i;
+			if (k > n) {
+				k = n;
+			}
+			memcpy(&s->queue[i], messages, k * sizeof(*messages));
+			__sync_synchronize();
+			int j;
+			for (j=0;j<k;j++) {
+				s->ready[i+j] = 1;
+			}
+		}
+		if (i <= s->cap && i + n > s->cap) {
+			//段满了，由预留范围包含段末尾的生产者链接新的段
+			struct mq_segment *next = segment_grow(q, s);
+			__sync_synchronize();
+			s->next = next;
+			q->tail = next;
+		} else if (k < n) {
+			//等待其他生产者链接新的段
+			while (q->tail == s) {
+				__sync_synchronize();
+			}
+		}
+		messages += k;
+		n -= k;
 	}
-	q->head = 0;
-	q->tail = q->cap;
-	q->cap *= 2;
-	
-	skynet_free(q->queue);
-	q->queue = new_queue;
+	ATOM_DEC(&q->producers);
 }
 
 //消息入指定消息队列
 void 
 skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 	assert(message);
-	SPIN_LOCK(q)
+	skynet_mq_push_batch(q, message, 1);
+}
+
+//n个消息入指定消息队列
+void
+skynet_mq_push_batch(struct message_queue *q, struct skynet_message *messages, int n) {
+	queue_push(q, messages, n);
 
-	//消息入队列
-	q->queue[q->tail] = *message;
-	if (++ q->tail >= q->cap) {
-		q->tail = 0;
+	//如果队列没在全局队列链表中，放入全局队列链表
+	if (q->in_global == 0 && ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+		int id;
+		if (RUNNEXT && messages[n-1].session != 0 && (id = worker_id()) > 0) {
+			//工作线程发出的请求或回应，交给本线程接下来直接调度，不经过全局队列
+			struct handoff *h = &RUNNEXT[id-1];
+			struct message_queue *old = h->q;
+			h->q = q;
+			if (old) {
+				skynet_globalmq_push(old);
+			}
+		} else {
+			skynet_globalmq_push(q);
+		}
 	}
+}
 
-	//队列满了，扩展队列大小
-	if (q->head == q->tail) {
-		expand_queue(q);
+//检查消息队列的水位，由生产者调用
+//长度达到高水位时饱和，饱和后长度降到低水位以下才恢复
+static int
+watermark_check(struct message_queue *q, int limit) {
+	if (q->high == 0) {
+		return MQ_PUSH_OK;
+	}
+	// count self as a producer, so the head segment can't be freed while reading the length
+	ATOM_INC(&q->producers);
+	int length = queue_length(q);
+	ATOM_DEC(&q->producers);
+	if (q->saturated) {
+		if (length <= q->low) {
+			ATOM_CAS(&q->saturated, 1, 0);
+		}
+	} else if (length >= q->high) {
+		ATOM_CAS(&q->saturated, 0, 1);
 	}
+	if (!q->saturated) {
+		return MQ_PUSH_OK;
+	}
+	if (limit == MQ_LIMIT_POLICY) {
+		return q->policy == MQ_WATERMARK_DROP ? MQ_PUSH_DROP : MQ_PUSH_REJECT;
+	}
+	if (limit == MQ_LIMIT_NONE) {
+		return MQ_PUSH_SATURATED;
+	}
+	// mark before push, so the consumer which dispatches this message must see it
+	ATOM_CAS(&q->paused, 0, 1);
+	return MQ_PUSH_SATURATED;
+}
 
-	//如果队列没在全局队列链表中，放入全局队列链表
-	if (q->in_global == 0) {
-		q->in_global = MQ_IN_GLOBAL;
-		skynet_globalmq_push(q);
+//带水位检查的入队列，只有MQ_LIMIT_POLICY会拒绝压入，MQ_LIMIT_PAUSE饱和时标记生产者已暂停
+int
+skynet_mq_push_limit(struct message_queue *q, struct skynet_message *messages, int n, int limit) {
+	int ret = watermark_check(q, limit);
+	if (ret == MQ_PUSH_OK || ret == MQ_PUSH_SATURATED) {
+		skynet_mq_push_batch(q, messages, n);
 	}
-	
-	SPIN_UNLOCK(q)
+	return ret;
+}
+
+//设置消息队列的高低水位，high为0时不限制
+void
+skynet_mq_watermark(struct message_queue *q, int high, int low, int policy) {
+	if (high < 0) {
+		high = 0;
+	}
+	if (low < 0 || low >= high) {
+		low = high / 2;
+	}
+	q->low = low;
+	q->policy = policy;
+	q->high = high;
+	if (high == 0) {
+		ATOM_CAS(&q->saturated, 1, 0);
+	}
+}
+
+//消息队列是否饱和，同时返回高低水位
+int
+skynet_mq_saturated(struct message_queue *q, int *high, int *low) {
+	if (high) {
+		*high = q->high;
+	}
+	if (low) {
+		*low = q->low;
+	}
+	return q->saturated;
+}
+
+//消费者分发后调用，队列降到低水位以下时解除饱和
+//返回1表示之前有生产者暂停了，需要通知其恢复
+int
+skynet_mq_drain(struct message_queue *q) {
+	if (!q->saturated && !q->paused) {
+		return 0;
+	}
+	if (q->saturated) {
+		if (q->high && queue_length(q) > q->low) {
+			return 0;
+		}
+		ATOM_CAS(&q->saturated, 1, 0);
+	}
+	return ATOM_CAS(&q->paused, 1, 0);
 }
 
 //初始化全局消息队列， 每个节点只有一个全局消息队列
+//worker > 0 时开启 work stealing 模式，为每个工作线程再创建一个私有队列
 void 
-skynet_mq_init() {
+skynet_mq_init(int worker) {
 	struct global_queue *q = skynet_malloc(sizeof(*q));
 	memset(q,0,sizeof(*q));
 	SPIN_INIT(q); //初始化自旋锁
 	Q=q;
+
+	if (worker > 0) {
+		worker_key_init(worker);
+		struct global_queue *lq = skynet_malloc(worker * sizeof(*lq));
+		memset(lq, 0, worker * sizeof(*lq));
+		int i;
+		for (i=0;i<worker;i++) {
+			SPIN_INIT(&lq[i]);
+		}
+		LQ = lq;
+	}
 }
 
 //标记消息队列 释放
 void 
 skynet_mq_mark_release(struct message_queue *q) {
-	SPIN_LOCK(q)
 	assert(q->release == 0);
 	q->release = 1;
-	if (q->in_global != MQ_IN_GLOBAL) {
+	__sync_synchronize();
+	if (ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
 		skynet_globalmq_push(q);
 	}
-	SPIN_UNLOCK(q)
 }
 
 //丢弃消息队列中的所有消息
 static void
 _drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
 	struct skynet_message msg;
-	while(!skynet_mq_pop(q, &msg)) {
+	while(!queue_pop(q, &msg)) {
 		drop_func(&msg, ud);
 	}
 	_release(q);
@@ -261,14 +846,10 @@ _drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
 //释放消息队列
 void 
 skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
-	SPIN_LOCK(q)
-	
 	//已标释放，则释放队列中的消息
 	if (q->release) {
-		SPIN_UNLOCK(q)
 		_drop_queue(q, drop_func, ud);
 	} else {
 		skynet_globalmq_push(q);
-		SPIN_UNLOCK(q)
 	}
 }
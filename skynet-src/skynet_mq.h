@@ -17,10 +17,36 @@ struct skynet_message {
 #define MESSAGE_TYPE_MASK (SIZE_MAX >> 8)
 #define MESSAGE_TYPE_SHIFT ((sizeof(size_t)-1) * 8)
 
+// scheduling priority class of a message queue
+#define MQ_PRIORITY_HIGH 0
+#define MQ_PRIORITY_NORMAL 1
+#define MQ_PRIORITY_LOW 2
+#define MQ_PRIORITY_COUNT 3
+
+// what a sender gets when the queue is above its high watermark
+#define MQ_WATERMARK_REJECT 0
+#define MQ_WATERMARK_DROP 1
+
+// return value of skynet_mq_push_limit
+#define MQ_PUSH_OK 0
+#define MQ_PUSH_SATURATED 1	// pushed, but the queue is above its high watermark
+#define MQ_PUSH_REJECT 2	// not pushed
+#define MQ_PUSH_DROP 3	// not pushed
+
+// limit of skynet_mq_push_limit
+#define MQ_LIMIT_PAUSE 0	// always push, mark the producer paused when saturated (socket)
+#define MQ_LIMIT_POLICY 1	// reject or drop by the policy of the queue when saturated
+#define MQ_LIMIT_NONE 2	// always push (response)
+
 struct message_queue;
 
 void skynet_globalmq_push(struct message_queue * queue);
 struct message_queue * skynet_globalmq_pop(void);
+void skynet_globalmq_bind(int id);	// bind current thread to worker queue id (work stealing or handoff mode)
+void skynet_globalmq_policy(int strict);	// 1 : strict priority , 0 : weighted
+struct message_queue * skynet_globalmq_runnext(void);	// the queue handed off to current worker, or NULL
+void skynet_globalmq_depth(int depth[MQ_PRIORITY_COUNT]);	// queues waiting in each priority class
+int skynet_globalmq_pending(int node);	// 1 when a worker on node can take a waiting queue
 
 struct message_queue * skynet_mq_create(uint32_t handle);
 void skynet_mq_mark_release(struct message_queue *q);
@@ -29,15 +55,32 @@ typedef void (*message_drop)(struct skynet_message *, void *);
 
 void skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud);
 uint32_t skynet_mq_handle(struct message_queue *);
+void skynet_mq_setpriority(struct message_queue *, int priority);
+int skynet_mq_priority(struct message_queue *);
 
 // 0 for success
 int skynet_mq_pop(struct message_queue *q, struct skynet_message *message);
+// pop at most max messages, return the number of messages (0 for empty)
+int skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *messages, int max);
+// give up an empty queue, return 1 when it's given up, 0 when it isn't empty
+int skynet_mq_idle(struct message_queue *q);
 void skynet_mq_push(struct message_queue *q, struct skynet_message *message);
+void skynet_mq_push_batch(struct message_queue *q, struct skynet_message *messages, int n);
+// push with the watermark check, limit is MQ_LIMIT_*
+int skynet_mq_push_limit(struct message_queue *q, struct skynet_message *messages, int n, int limit);
+
+// high == 0 disables the watermark
+void skynet_mq_watermark(struct message_queue *q, int high, int low, int policy);
+int skynet_mq_saturated(struct message_queue *q, int *high, int *low);
+// called by the consumer after dispatch, return 1 when the paused producers should resume
+int skynet_mq_drain(struct message_queue *q);
 
 // return the length of message queue, for debug
 int skynet_mq_length(struct message_queue *q);
 int skynet_mq_overload(struct message_queue *q);
 
-void skynet_mq_init();
+void skynet_mq_init(int worker);	// worker > 0 enables per-worker queues with work stealing
+void skynet_mq_numa(int worker, const int *node);	// keep each queue on the NUMA node of the worker which dispatches it first
+void skynet_mq_handoff(int worker);	// a worker dispatches the queue it wakes up by a request or response directly
 
 #endif
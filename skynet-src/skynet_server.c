@@ -11,6 +11,7 @@
 #include "skynet_imp.h"
 #include "skynet_log.h"
 #include "skynet_timer.h"
+#include "skynet_socket.h"
 #include "spinlock.h"
 #include "atomic.h"
 
@@ -22,6 +23,11 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+// max messages popped from a service queue at once
+#define DISPATCH_BATCH 32
+// skynet_send_batch builds up to this many messages on the stack, more are allocated
+#define SEND_BATCH 32
+
 #ifdef CALLING_CHECK
 
 #define CHECKCALLING_BEGIN(ctx) if (!(spinlock_trylock(&ctx->calling))) { assert(0); }
@@ -40,6 +46,16 @@
 
 #endif
 
+#define NAME_CACHE_SIZE 8
+#define NAME_CACHE_LENGTH 32
+
+//服务缓存的目标名称地址，名称映射的版本改变后失效
+struct name_cache {
+	uint32_t handle;
+	uint32_t version;
+	char name[NAME_CACHE_LENGTH];
+};
+
 //skynet服务的总体结构
 struct skynet_context {
 	void * instance; //模块实例
@@ -50,6 +66,7 @@ struct skynet_context {
 	FILE * logfile; //log文件
 	uint64_t cpu_cost;	// in microsec //cpu使用时间
 	uint64_t cpu_start;	// in microsec //cpu开始时间
+	uint32_t msg_cost;	// in nanosec //自适应调度模式下，每个消息平均花费的cpu时间
 	char result[32];
 	uint32_t handle; //分配的服务地址
 	int session_id;
@@ -58,6 +75,7 @@ struct skynet_context {
 	bool init; //标记 服务是否已经初始化过了
 	bool endless; //标记 该服务是不是死循环了
 	bool profile; //是否打开性能统计
+	struct name_cache name_cache[NAME_CACHE_SIZE]; //skynet_sendname的目标地址缓存
 
 	CHECKCALLING_DECL //自旋锁
 };
@@ -69,6 +87,7 @@ struct skynet_node {
 	uint32_t monitor_exit; //监测器是否退出
 	pthread_key_t handle_key; //线程特殊值，该值所有线程都可以访问，但是在每个线程中值都不一样。
 	bool profile;	// default is off //是否打开性能统计
+	uint32_t quantum;	// in nanosec, 0 means use the weight of worker //自适应调度模式下每次分发的时间预算
 };
 
 static struct skynet_node G_NODE;
@@ -160,8 +179,10 @@ skynet_context_new(const char * name, const char *param) {
 
 	ctx->cpu_cost = 0;
 	ctx->cpu_start = 0;
+	ctx->msg_cost = 0;
 	ctx->message_count = 0;
 	ctx->profile = G_NODE.profile;
+	memset(ctx->name_cache, 0, sizeof(ctx->name_cache));
 	// Should set to 0 first to avoid skynet_handle_retireall get an uninitialized handle
 	ctx->handle = 0;	
 	ctx->handle = skynet_handle_register(ctx); //给服务分配地址
@@ -254,6 +275,32 @@ skynet_context_push(uint32_t handle, struct skynet_message *message) {
 	return 0;
 }
 
+//通过服务地址，往其服务队列中批量压入n个消息，只grab一次
+int
+skynet_context_push_batch(uint32_t handle, struct skynet_message *messages, int n) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return -1;
+	}
+	skynet_mq_push_batch(ctx->queue, messages, n);
+	skynet_context_release(ctx);
+	return 0;
+}
+
+//按目标服务的水位压入消息，消息不会被释放
+//返回 -1 地址无效，MQ_PUSH_REJECT/MQ_PUSH_DROP 没有压入（limit为MQ_LIMIT_POLICY时）
+//MQ_PUSH_SATURATED 已压入但目标饱和（其它limit）
+int
+skynet_context_push_limit(uint32_t handle, struct skynet_message *messages, int n, int limit) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return -1;
+	}
+	int ret = skynet_mq_push_limit(ctx->queue, messages, n, limit);
+	skynet_context_release(ctx);
+	return ret;
+}
+
 //标记服务处于死循环了
 void 
 skynet_context_endless(uint32_t handle) {
@@ -301,6 +348,28 @@ dispatch_message(struct skynet_context *ctx, struct skynet_message *msg) {
 	CHECKCALLING_END(ctx)
 }
 
+//自适应调度模式下，更新服务每个消息的平均花费(指数移动平均)
+//开启性能统计时直接使用cpu_cost，否则自己计时
+static void
+update_cost(struct skynet_context *ctx, uint64_t cost_start, int count_start) {
+	int count = ctx->message_count - count_start;
+	if (count <= 0) {
+		return;
+	}
+	uint64_t cost = (ctx->profile ? ctx->cpu_cost : skynet_thread_time()) - cost_start;
+	uint64_t avg = cost * 1000 / count;	// microsec to nanosec
+	if (avg == 0) {
+		avg = 1;
+	} else if (avg > UINT32_MAX) {
+		avg = UINT32_MAX;
+	}
+	if (ctx->msg_cost == 0) {
+		ctx->msg_cost = (uint32_t)avg;
+	} else {
+		ctx->msg_cost = (uint32_t)(((uint64_t)ctx->msg_cost * 3 + avg) / 4);
+	}
+}
+
 //处理指定服务服务队列中的全部消息
 void 
 skynet_context_dispatchall(struct skynet_context * ctx) {
@@ -312,6 +381,16 @@ skynet_context_dispatchall(struct skynet_context * ctx) {
 	}
 }
 
+//下一个要分发的消息队列，优先调度直接交接给本线程的
+static inline struct message_queue *
+next_queue() {
+	struct message_queue *q = skynet_globalmq_runnext();
+	if (q) {
+		return q;
+	}
+	return skynet_globalmq_pop();
+}
+
 //消息分发
 struct message_queue * 
 skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue *q, int weight) {
@@ -329,21 +408,51 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 	if (ctx == NULL) {
 		struct drop_t d = { handle };
 		skynet_mq_release(q, drop_message, &d);
-		return skynet_globalmq_pop();
+		return next_queue();
 	}
 
-	int i,n=1;
-	struct skynet_message msg;
+	//按权重决定本次处理的消息数量，weight < 0 时只处理一条
+	//自适应模式下，按该服务每个消息的平均花费决定，使本次分发的时间接近时间预算
+	int n = 1;
+	if (G_NODE.quantum) {
+		if (ctx->msg_cost > 0) {
+			n = G_NODE.quantum / ctx->msg_cost;
+			int length = skynet_mq_length(q);
+			if (n > length) {
+				n = length;
+			}
+			if (n < 1) {
+				n = 1;
+			}
+		}
+	} else if (weight >= 0) {
+		n = skynet_mq_length(q) >> weight;
+		if (n < 1) {
+			n = 1;
+		}
+	}
 
-	for (i=0;i<n;i++) {
-		//从消息队列中pop出来一个消息
-		if (skynet_mq_pop(q,&msg)) {
+	struct skynet_message msg[DISPATCH_BATCH];
+	uint64_t cost_start = 0;
+	int count_start = ctx->message_count;
+	if (G_NODE.quantum) {
+		cost_start = ctx->profile ? ctx->cpu_cost : skynet_thread_time();
+	}
+
+	while (n > 0) {
+		//从消息队列中批量pop出消息
+		int i, sz = skynet_mq_pop_batch(q, msg, n < DISPATCH_BATCH ? n : DISPATCH_BATCH);
+		if (sz == 0) {
+			if (G_NODE.quantum) {
+				update_cost(ctx, cost_start, count_start);
+			}
+			if (skynet_mq_drain(q)) {
+				skynet_socket_resume(handle);
+			}
 			skynet_context_release(ctx);
-			return skynet_globalmq_pop();
-		} else if (i==0 && weight >= 0) {
-			n = skynet_mq_length(q);
-			n >>= weight;
+			return next_queue();
 		}
+		n -= sz;
 
 		//检查消息队列是否过载
 		int overload = skynet_mq_overload(q);
@@ -351,21 +460,40 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 			skynet_error(ctx, "May overload, message queue length = %d", overload);
 		}
 
-		//消息的source为来源地址，队列的所在context的handle就为目标地址
-		//在监控其中记录消息的流向
-		skynet_monitor_trigger(sm, msg.source , handle);
+		for (i=0;i<sz;i++) {
+			//消息的source为来源地址，队列的所在context的handle就为目标地址
+			//在监控其中记录消息的流向
+			skynet_monitor_trigger(sm, msg[i].source , handle);
 
-		//调用服务内的消息回掉函数
-		if (ctx->cb == NULL) {
-			skynet_free(msg.data); //该消息的目标服务未注册回掉函数，释放掉该消息
-		} else {
-			dispatch_message(ctx, &msg); //调用消息的回掉函数，处理消息
+			//调用服务内的消息回掉函数
+			if (ctx->cb == NULL) {
+				skynet_free(msg[i].data); //该消息的目标服务未注册回掉函数，释放掉该消息
+			} else {
+				dispatch_message(ctx, &msg[i]); //调用消息的回掉函数，处理消息
+			}
+			//消息处理完成，重置监控中的消息流向记录
+			skynet_monitor_trigger(sm, 0,0);
 		}
-		//消息处理完成，重置监控中的消息流向记录
-		skynet_monitor_trigger(sm, 0,0);
+	}
+	if (G_NODE.quantum) {
+		update_cost(ctx, cost_start, count_start);
+	}
+	//降到低水位以下，恢复因本服务饱和而暂停读取的socket
+	if (skynet_mq_drain(q)) {
+		skynet_socket_resume(handle);
 	}
 
 	assert(q == ctx->queue);
+	//本次分发唤醒了其他服务（如skynet.call的目标），直接调度它
+	//q通常在等待回应，队列为空时放弃它，回应时就可以再直接交接回来
+	struct message_queue *rq = skynet_globalmq_runnext();
+	if (rq) {
+		if (!skynet_mq_idle(q)) {
+			skynet_globalmq_push(q);
+		}
+		skynet_context_release(ctx);
+		return rq;
+	}
 	//如果全局消息队列不为空，将q重新压入全局队列，并返回下一个消息队列，进行分发处理
 	//如果全局队列为空了或者阻塞了，则继续处理该消息队列中的消息
 	struct message_queue *nq = skynet_globalmq_pop();
@@ -391,6 +519,14 @@ copy_name(char name[GLOBALNAME_LENGTH], const char * addr) {
 	}
 }
 
+//harbor已知的全局名称地址
+static inline uint32_t
+global_findname(const char * addr) {
+	char name[GLOBALNAME_LENGTH];
+	copy_name(name, addr);
+	return skynet_harbor_findname(name);
+}
+
 uint32_t 
 skynet_queryname(struct skynet_context * context, const char * name) {
 	switch(name[0]) {
@@ -434,6 +570,37 @@ cmd_timeout(struct skynet_context * context, const char * param) {
 	return context->result;
 }
 
+//毫秒精度的定时器，实际精度取决于timer_resolution
+static const char *
+cmd_timeoutms(struct skynet_context * context, const char * param) {
+	int ti = strtol(param, NULL, 10);
+	int session = skynet_context_newsession(context);
+	skynet_timeout_ms(context->handle, ti, session);
+	sprintf(context->result, "%d", session);
+	return context->result;
+}
+
+//合并的定时器，同一个tick到期的定时器共用时间轮里的一个节点
+static const char *
+cmd_timeoutgroup(struct skynet_context * context, const char * param) {
+	int ti = strtol(param, NULL, 10);
+	int session = skynet_context_newsession(context);
+	skynet_timeout_group(context->handle, ti, session);
+	sprintf(context->result, "%d", session);
+	return context->result;
+}
+
+//取消定时器，成功时返回session，已经到期(或不存在)时返回NULL
+static const char *
+cmd_canceltimeout(struct skynet_context * context, const char * param) {
+	int session = strtol(param, NULL, 10);
+	if (skynet_timeout_cancel(context->handle, session)) {
+		return NULL;
+	}
+	sprintf(context->result, "%d", session);
+	return context->result;
+}
+
 //注册全局名称
 static const char *
 cmd_reg(struct skynet_context * context, const char * param) {
@@ -606,6 +773,9 @@ cmd_stat(struct skynet_context * context, const char * param) {
 		}
 	} else if (strcmp(param, "message") == 0) {
 		sprintf(context->result, "%d", context->message_count);
+	} else if (strcmp(param, "msgcost") == 0) {
+		double t = (double)context->msg_cost / 1000000000.0;	// nanosec
+		sprintf(context->result, "%lf", t);
 	} else {
 		context->result[0] = '\0';
 	}
@@ -674,8 +844,101 @@ cmd_signal(struct skynet_context * context, const char * param) {
 	return NULL;
 }
 
+static const char * PRIORITY_NAME[MQ_PRIORITY_COUNT] = {
+	"high", "normal", "low",
+};
+
+//设置服务的调度优先级，param为 "[address] high|normal|low"，没有address时设置自己
+//没有参数时返回自己的优先级
+static const char *
+cmd_priority(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
+		return PRIORITY_NAME[skynet_mq_priority(context->queue)];
+	}
+	uint32_t handle = context->handle;
+	const char * level = param;
+	if (param[0] == ':' || param[0] == '.') {
+		int sz = strlen(param);
+		char addr[sz+1];
+		level = strchr(param, ' ');
+		if (level == NULL) {
+			return NULL;
+		}
+		memcpy(addr, param, level - param);
+		addr[level - param] = '\0';
+		++level;
+		handle = tohandle(context, addr);
+		if (handle == 0) {
+			return NULL;
+		}
+	}
+	int i;
+	for (i=0;i<MQ_PRIORITY_COUNT;i++) {
+		if (strcmp(level, PRIORITY_NAME[i]) == 0) {
+			break;
+		}
+	}
+	if (i == MQ_PRIORITY_COUNT) {
+		skynet_error(context, "Invalid priority %s", level);
+		return NULL;
+	}
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL)
+		return NULL;
+	skynet_mq_setpriority(ctx->queue, i);
+	skynet_context_release(ctx);
+	return PRIORITY_NAME[i];
+}
+
+//各优先级等待调度的服务数量，格式为 "high normal low"
+static const char *
+cmd_runqueue(struct skynet_context * context, const char * param) {
+	int depth[MQ_PRIORITY_COUNT];
+	skynet_globalmq_depth(depth);
+	sprintf(context->result, "%d %d %d", depth[MQ_PRIORITY_HIGH], depth[MQ_PRIORITY_NORMAL], depth[MQ_PRIORITY_LOW]);
+	return context->result;
+}
+
+//timer线程醒晚的次数和最大延迟(毫秒)，返回 "count maxlag"
+static const char *
+cmd_timerskew(struct skynet_context * context, const char * param) {
+	uint32_t count, max_lag;
+	skynet_timer_skew(&count, &max_lag);
+	sprintf(context->result, "%u %u", count, max_lag);
+	return context->result;
+}
+
+//设置自己的消息队列水位，param为 "high low [reject|drop]"，high为0时关闭
+//没有参数时返回 "length high low saturated"
+static const char *
+cmd_watermark(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
+		int high, low;
+		int saturated = skynet_mq_saturated(context->queue, &high, &low);
+		sprintf(context->result, "%d %d %d %d", skynet_mq_length(context->queue), high, low, saturated);
+		return context->result;
+	}
+	int high = 0, low = -1;
+	char policy[16] = "reject";
+	sscanf(param, "%d %d %15s", &high, &low, policy);
+	int p;
+	if (strcmp(policy, "reject") == 0) {
+		p = MQ_WATERMARK_REJECT;
+	} else if (strcmp(policy, "drop") == 0) {
+		p = MQ_WATERMARK_DROP;
+	} else {
+		skynet_error(context, "Invalid watermark policy %s", policy);
+		return NULL;
+	}
+	skynet_mq_watermark(context->queue, high, low, p);
+	return NULL;
+}
+
 static struct command_func cmd_funcs[] = {
 	{ "TIMEOUT", cmd_timeout },
+	{ "TIMEOUTMS", cmd_timeoutms },
+	{ "TIMEOUTGROUP", cmd_timeoutgroup },
+	{ "CANCELTIMEOUT", cmd_canceltimeout },
 	{ "REG", cmd_reg },
 	{ "QUERY", cmd_query },
 	{ "NAME", cmd_name },
@@ -691,6 +954,10 @@ static struct command_func cmd_funcs[] = {
 	{ "LOGON", cmd_logon },
 	{ "LOGOFF", cmd_logoff },
 	{ "SIGNAL", cmd_signal },
+	{ "PRIORITY", cmd_priority },
+	{ "RUNQUEUE", cmd_runqueue },
+	{ "TIMERSKEW", cmd_timerskew },
+	{ "WATERMARK", cmd_watermark },
 	{ NULL, NULL },
 };
 
@@ -775,15 +1042,121 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 		smsg.data = data;
 		smsg.sz = sz;
 
-		//push成功，释放data所指向的空间
-		if (skynet_context_push(destination, &smsg)) {
+		//回应和错误消息不受水位限制，否则请求方会一直等待
+		int limit = ((type & 0xff) == PTYPE_RESPONSE || (type & 0xff) == PTYPE_ERROR) ? MQ_LIMIT_NONE : MQ_LIMIT_POLICY;
+		int ret = skynet_context_push_limit(destination, &smsg, 1, limit);
+		//MQ_PUSH_SATURATED 表示已经压入了
+		if (ret != MQ_PUSH_OK && ret != MQ_PUSH_SATURATED) {
+			//push失败，释放data所指向的空间
 			skynet_free(data);
-			return -1;
+			if (ret < 0) {
+				return -1;
+			}
+			// a request with session expects a response, so it can't be dropped silently
+			if (ret == MQ_PUSH_DROP && session == 0) {
+				return 0;
+			}
+			return SKYNET_SATURATED;
 		}
 	}
 	return session;
 }
 
+//向同一个目标批量发送n个消息，session都为0
+//成功返回0，目标地址无效返回-1，目标饱和返回SKYNET_SATURATED（消息都会被释放）
+int
+skynet_send_batch(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int n, void * msg[], size_t sz[]) {
+	int i;
+	if (n <= 0) {
+		return 0;
+	}
+	for (i=0;i<n;i++) {
+		if ((sz[i] & MESSAGE_TYPE_MASK) != sz[i]) {
+			skynet_error(context, "The message to %x is too large", destination);
+			if (type & PTYPE_TAG_DONTCOPY) {
+				for (i=0;i<n;i++) {
+					skynet_free(msg[i]);
+				}
+			}
+			return -1;
+		}
+	}
+	type &= ~PTYPE_TAG_ALLOCSESSION;
+	if (source == 0) {
+		source = context->handle;
+	}
+	if (destination == 0 || skynet_harbor_message_isremote(destination)) {
+		for (i=0;i<n;i++) {
+			skynet_send(context, source, destination, type, 0, msg[i], sz[i]);
+		}
+		return 0;
+	}
+
+	struct skynet_message tmp[SEND_BATCH];
+	struct skynet_message *smsg = tmp;
+	if (n > SEND_BATCH) {
+		smsg = skynet_malloc(n * sizeof(*smsg));
+	}
+	for (i=0;i<n;i++) {
+		int session = 0;
+		void * data = msg[i];
+		size_t size = sz[i];
+		_filter_args(context, type, &session, &data, &size);
+		smsg[i].source = source;
+		smsg[i].session = 0;
+		smsg[i].data = data;
+		smsg[i].sz = size;
+	}
+	int ret = skynet_context_push_limit(destination, smsg, n, MQ_LIMIT_POLICY);
+	if (ret != MQ_PUSH_OK) {
+		for (i=0;i<n;i++) {
+			skynet_free(smsg[i].data);
+		}
+		if (ret == MQ_PUSH_DROP) {
+			ret = 0;
+		} else if (ret == MQ_PUSH_REJECT) {
+			ret = SKYNET_SATURATED;
+		}
+	}
+	if (smsg != tmp) {
+		skynet_free(smsg);
+	}
+	return ret;
+}
+
+static inline struct name_cache *
+name_cache_slot(struct skynet_context * context, const char * name) {
+	uint32_t h = 0;
+	const char * p = name;
+	while (*p) {
+		h = h * 31 + (uint8_t)*p++;
+	}
+	return &context->name_cache[h % NAME_CACHE_SIZE];
+}
+
+//查询缓存的名称地址，没有或已失效返回0
+static uint32_t
+name_cache_query(struct skynet_context * context, const char * name, uint32_t version) {
+	struct name_cache *c = name_cache_slot(context, name);
+	if (c->handle && c->version == version && strcmp(c->name, name) == 0) {
+		return c->handle;
+	}
+	return 0;
+}
+
+//缓存名称地址，version为查询前的版本，查询期间映射改变了缓存也会失效
+static void
+name_cache_update(struct skynet_context * context, const char * name, uint32_t handle, uint32_t version) {
+	size_t sz = strlen(name);
+	if (sz >= NAME_CACHE_LENGTH) {
+		return;
+	}
+	struct name_cache *c = name_cache_slot(context, name);
+	c->handle = handle;
+	c->version = version;
+	memcpy(c->name, name, sz+1);
+}
+
 int
 skynet_sendname(struct skynet_context * context, uint32_t source, const char * addr , int type, int session, void * data, size_t sz) {
 	if (source == 0) {
@@ -792,25 +1165,37 @@ skynet_sendname(struct skynet_context * context, uint32_t source, const char * a
 	uint32_t des = 0;
 	if (addr[0] == ':') {
 		des = strtoul(addr+1, NULL, 16);
-	} else if (addr[0] == '.') {
-		des = skynet_handle_findname(addr + 1);
+	} else {
+		//重复向同一个名称发送，直接使用缓存的地址
+		uint32_t version = skynet_handle_nameversion();
+		des = name_cache_query(context, addr, version);
 		if (des == 0) {
-			if (type & PTYPE_TAG_DONTCOPY) {
-				skynet_free(data);
+			if (addr[0] == '.') {
+				des = skynet_handle_findname(addr + 1);
+				if (des == 0) {
+					if (type & PTYPE_TAG_DONTCOPY) {
+						skynet_free(data);
+					}
+					return -1;
+				}
+			} else {
+				//harbor还不知道该全局名称的地址，交给harbor按名称发送
+				des = global_findname(addr);
+				if (des == 0) {
+					_filter_args(context, type, &session, (void **)&data, &sz);
+
+					struct remote_message * rmsg = skynet_malloc(sizeof(*rmsg));
+					copy_name(rmsg->destination.name, addr);
+					rmsg->destination.handle = 0;
+					rmsg->message = data;
+					rmsg->sz = sz;
+
+					skynet_harbor_send(rmsg, source, session);
+					return session;
+				}
 			}
-			return -1;
+			name_cache_update(context, addr, des, version);
 		}
-	} else {
-		_filter_args(context, type, &session, (void **)&data, &sz);
-
-		struct remote_message * rmsg = skynet_malloc(sizeof(*rmsg));
-		copy_name(rmsg->destination.name, addr);
-		rmsg->destination.handle = 0;
-		rmsg->message = data;
-		rmsg->sz = sz;
-
-		skynet_harbor_send(rmsg, source, session);
-		return session;
 	}
 
 	return skynet_send(context, source, des, type, session, data, sz);
@@ -872,3 +1257,9 @@ void
 skynet_profile_enable(int enable) {
 	G_NODE.profile = (bool)enable;
 }
+
+//自适应调度模式，每次分发一个服务的时间预算，单位微秒，0表示使用工作线程的权重
+void
+skynet_dispatch_quantum(int microsec) {
+	G_NODE.quantum = microsec > 0 ? (uint32_t)microsec * 1000 : 0;
+}
@@ -14,6 +14,8 @@ void skynet_context_reserve(struct skynet_context *ctx);
 struct skynet_context * skynet_context_release(struct skynet_context *);
 uint32_t skynet_context_handle(struct skynet_context *);
 int skynet_context_push(uint32_t handle, struct skynet_message *message);
+int skynet_context_push_batch(uint32_t handle, struct skynet_message *messages, int n);
+int skynet_context_push_limit(uint32_t handle, struct skynet_message *messages, int n, int limit);	// return -1 or MQ_PUSH_*
 void skynet_context_send(struct skynet_context * context, void * msg, size_t sz, uint32_t source, int type, int session);
 int skynet_context_newsession(struct skynet_context *);
 struct message_queue * skynet_context_message_dispatch(struct skynet_monitor *, struct message_queue *, int weight);	// return next queue
@@ -27,5 +29,6 @@ void skynet_globalexit(void);
 void skynet_initthread(int m);
 
 void skynet_profile_enable(int enable);
+void skynet_dispatch_quantum(int microsec);	// 0 : use the weight of worker thread
 
 #endif
@@ -13,10 +13,12 @@
 
 static struct socket_server * SOCKET_SERVER = NULL;
 
-//创建socket_server
+//创建socket_server，thread个socket线程
+//direct_write: 发送缓冲区为空时，工作线程直接写socket
 void 
-skynet_socket_init() {
-	SOCKET_SERVER = socket_server_create();
+skynet_socket_init(int thread, int direct_write) {
+	SOCKET_SERVER = socket_server_create(thread);
+	socket_server_directwrite(SOCKET_SERVER, direct_write);
 }
 
 //退出socket_server
@@ -84,23 +86,41 @@ forward_message(int type, bool padding, struct socket_message * result) {
 	message.data = sm;
 	message.sz = sz | ((size_t)PTYPE_SOCKET << MESSAGE_TYPE_SHIFT);
 	
-	//往服务中压入消息
-	if (skynet_context_push((uint32_t)result->opaque, &message)) {
+	//往服务中压入消息，socket消息不受水位限制
+	int ret = skynet_context_push_limit((uint32_t)result->opaque, &message, 1, MQ_LIMIT_PAUSE);
+	if (ret < 0) {
 		// todo: report somewhere to close socket
 		// don't call skynet_socket_close here (It will block mainloop)
 		skynet_free(sm->buffer);
 		skynet_free(sm);
+	} else if (ret == MQ_PUSH_SATURATED) {
+		//服务饱和，暂停读取该socket，等服务的消息队列降到低水位再恢复
+		if (type == SKYNET_SOCKET_TYPE_DATA || type == SKYNET_SOCKET_TYPE_UDP || type == SKYNET_SOCKET_TYPE_UDPBATCH || type == SKYNET_SOCKET_TYPE_ACCEPT) {
+			socket_server_pause(SOCKET_SERVER, result->id);
+		}
 	}
 }
 
-//开始socket poll
+//恢复读取属于服务handle的socket
+void
+skynet_socket_resume(uint32_t handle) {
+	socket_server_resume(SOCKET_SERVER, handle);
+}
+
+//发送数据的系统调用次数和发送完的包数
+void
+skynet_socket_sendstat(uint64_t *syscall, uint64_t *message) {
+	socket_server_sendstat(SOCKET_SERVER, syscall, message);
+}
+
+//开始socket poll，thread为第几个socket线程
 int 
-skynet_socket_poll() {
+skynet_socket_poll(int thread) {
 	struct socket_server *ss = SOCKET_SERVER;
 	assert(ss);
 	struct socket_message result;
 	int more = 1;
-	int type = socket_server_poll(ss, &result, &more);
+	int type = socket_server_poll(ss, thread, &result, &more);
 	switch (type) {
 	case SOCKET_EXIT:
 		return 0;
@@ -125,6 +145,9 @@ skynet_socket_poll() {
 	case SOCKET_WARNING:
 		forward_message(SKYNET_SOCKET_TYPE_WARNING, false, &result);
 		break;
+	case SOCKET_UDPBATCH:
+		forward_message(SKYNET_SOCKET_TYPE_UDPBATCH, false, &result);
+		break;
 	default:
 		skynet_error(NULL, "Unknown socket message type %d.",type);
 		return -1;
@@ -1,6 +1,8 @@
 #ifndef skynet_socket_h
 #define skynet_socket_h
 
+#include <stdint.h>
+
 struct skynet_context;
 
 #define SKYNET_SOCKET_TYPE_DATA 1
@@ -10,6 +12,7 @@ struct skynet_context;
 #define SKYNET_SOCKET_TYPE_ERROR 5
 #define SKYNET_SOCKET_TYPE_UDP 6
 #define SKYNET_SOCKET_TYPE_WARNING 7
+#define SKYNET_SOCKET_TYPE_UDPBATCH 8	// several udp packages in one buffer, see forward_message_udp in socket_server.c
 
 struct skynet_socket_message {
 	int type;
@@ -18,10 +21,12 @@ struct skynet_socket_message {
 	char * buffer;
 };
 
-void skynet_socket_init();
+void skynet_socket_init(int thread, int direct_write);	// the number of socket threads, and write in the worker when the socket is idle
 void skynet_socket_exit();
 void skynet_socket_free();
-int skynet_socket_poll();
+int skynet_socket_poll(int thread);
+void skynet_socket_resume(uint32_t handle);	// resume reading the sockets paused by the watermark of handle
+void skynet_socket_sendstat(uint64_t *syscall, uint64_t *message);	// the syscalls writing the sockets, and the packages sent
 
 int skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz);
 int skynet_socket_send_lowpriority(struct skynet_context *ctx, int id, void *buffer, int sz);
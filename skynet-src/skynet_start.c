@@ -1,3 +1,7 @@
+#if defined(__linux__)
+#define _GNU_SOURCE	// for CPU_SET and sched_setaffinity
+#endif
+
 #include "skynet.h"
 #include "skynet_server.h"
 #include "skynet_imp.h"
@@ -18,14 +22,55 @@
 #include <string.h>
 #include <signal.h>
 
+#include "atomic.h"
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#define PARK_FUTEX
+#endif
+
+#define CPUSET_MAX 256
+
+#ifndef CPU_SETSIZE
+#define CPU_SETSIZE 1024
+#endif
+
+#define TIMER_IDLE_WAIT 100000 //空闲时timer线程最多睡100毫秒，用于检查退出和信号
+
+#define PARK_RUNNING 0
+#define PARK_SLEEP 1
+
+//工作线程的挂起槽，每个工作线程一个，唤醒时可以指定唤醒哪个线程
+struct park_slot {
+	int state; //PARK_SLEEP 表示挂起中
+#ifndef PARK_FUTEX
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+	char padding[64]; //避免不同线程的槽在同一个cache line
+};
+
+//绑定的cpu列表，n为0表示不绑定
+struct cpuset {
+	int n;
+	int cpu[CPUSET_MAX];
+};
+
 //全局的监测器
 struct monitor {
 	int count; //工作线程数量
 	struct skynet_monitor ** m; //存储工作线程的监测器的指针数组，每个工作线程都有一个监测器
-	pthread_cond_t cond; //条件变量
-	pthread_mutex_t mutex; //互斥锁
+	struct park_slot * park; //工作线程的挂起槽
 	int sleep; //挂起的工作线程数量
+	int next; //下次开始查找挂起线程的位置，使唤醒分散到各个线程
 	int quit; //标记是否退出
+	struct cpuset worker_cpu; //工作线程依次绑定到其中一个cpu
+	struct cpuset socket_cpu; //socket线程绑定的cpu
+	int socket_thread; //socket线程数
+	struct cpuset timer_cpu; //timer线程绑定的cpu
+	int *node; //NUMA模式下每个工作线程所在的节点，否则为NULL
 };
 
 //工作线程的参数，monitor
@@ -35,6 +80,12 @@ struct worker_parm {
 	int weight; //权重
 };
 
+//socket线程的参数
+struct socket_parm {
+	struct monitor *m;
+	int id; //第几个socket线程，处理自己的epoll
+};
+
 static int SIG = 0;
 
 static void
@@ -56,22 +107,207 @@ create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg) {
 	}
 }
 
-//唤醒，给挂起线程发送信号，一次唤醒一个
+#ifdef PARK_FUTEX
+
+static void
+park_init(struct park_slot *p) {
+	p->state = PARK_RUNNING;
+}
+
+static void
+park_destroy(struct park_slot *p) {
+}
+
+//挂起，直到state不再是PARK_SLEEP，"spurious wakeup" is harmless
+static void
+park_wait(struct park_slot *p) {
+	syscall(SYS_futex, &p->state, FUTEX_WAIT_PRIVATE, PARK_SLEEP, NULL, NULL, 0);
+}
+
+static void
+park_signal(struct park_slot *p) {
+	syscall(SYS_futex, &p->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#else
+
+static void
+park_init(struct park_slot *p) {
+	p->state = PARK_RUNNING;
+	if (pthread_mutex_init(&p->mutex, NULL)) { //初始化互斥锁
+		fprintf(stderr, "Init mutex error");
+		exit(1);
+	}
+	if (pthread_cond_init(&p->cond, NULL)) { //初始化条件变量
+		fprintf(stderr, "Init cond error");
+		exit(1);
+	}
+}
+
+static void
+park_destroy(struct park_slot *p) {
+	pthread_mutex_destroy(&p->mutex);
+	pthread_cond_destroy(&p->cond);
+}
+
+static void
+park_wait(struct park_slot *p) {
+	pthread_mutex_lock(&p->mutex);
+	if (p->state == PARK_SLEEP) {
+		pthread_cond_wait(&p->cond, &p->mutex);
+	}
+	pthread_mutex_unlock(&p->mutex);
+}
+
+static void
+park_signal(struct park_slot *p) {
+	pthread_mutex_lock(&p->mutex);
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+#endif
+
+//解析cpu列表，格式如 "0-3,8,10-11"
+static void
+cpuset_parse(struct cpuset *set, const char *str) {
+	set->n = 0;
+	if (str == NULL) {
+		return;
+	}
+	while (*str) {
+		char *endptr;
+		int from = strtol(str, &endptr, 10);
+		int to = from;
+		if (endptr == str || from < 0 || from >= CPU_SETSIZE) {
+			fprintf(stderr, "Invalid cpu list : %s\n", str);
+			exit(1);
+		}
+		str = endptr;
+		if (*str == '-') {
+			++str;
+			to = strtol(str, &endptr, 10);
+			if (endptr == str || to < from || to >= CPU_SETSIZE) {
+				fprintf(stderr, "Invalid cpu list : %s\n", str);
+				exit(1);
+			}
+			str = endptr;
+		}
+		for (;from <= to && set->n < CPUSET_MAX; from++) {
+			set->cpu[set->n++] = from;
+		}
+		if (*str == ',') {
+			++str;
+		} else if (*str) {
+			fprintf(stderr, "Invalid cpu list : %s\n", str);
+			exit(1);
+		}
+	}
+}
+
+//把当前线程绑定到set中的cpu上，index >= 0 时只绑定到第index个cpu
+static void
+cpuset_bind(struct cpuset *set, int index) {
+	if (set->n == 0) {
+		return;
+	}
+#if defined(__linux__)
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	if (index >= 0) {
+		CPU_SET(set->cpu[index % set->n], &mask);
+	} else {
+		int i;
+		for (i=0;i<set->n;i++) {
+			CPU_SET(set->cpu[i], &mask);
+		}
+	}
+	if (sched_setaffinity(0, sizeof(mask), &mask)) {
+		skynet_error(NULL, "Set cpu affinity failed");
+	}
+#else
+	skynet_error(NULL, "Cpu affinity is not supported on this platform");
+#endif
+}
+
+//cpu所在的NUMA节点
+static int
+cpu_node(int cpu) {
+#if defined(__linux__)
+	char path[64];
+	int node;
+	for (node=0;node<CPUSET_MAX;node++) {
+		sprintf(path, "/sys/devices/system/node/node%d/cpu%d", node, cpu);
+		if (access(path, F_OK) == 0) {
+			return node;
+		}
+	}
+#endif
+	return 0;
+}
+
+//唤醒指定的挂起线程，线程没有挂起时返回0
+static int
+park_wakeup(struct park_slot *p) {
+	if (p->state == PARK_SLEEP && ATOM_CAS(&p->state, PARK_SLEEP, PARK_RUNNING)) {
+		park_signal(p);
+		return 1;
+	}
+	return 0;
+}
+
+//唤醒，挑选一个挂起的工作线程唤醒，没有挂起线程时不做系统调用
 static void
 wakeup(struct monitor *m, int busy) {
+	// the queue is pushed before reading sleep, pairs with ATOM_INC(&m->sleep) in thread_worker
+	__sync_synchronize();
 	if (m->sleep >= m->count - busy) {
-		// signal sleep worker, "spurious wakeup" is harmless
-		pthread_cond_signal(&m->cond);
+		int i;
+		int start = m->next;
+		if (m->node) {
+			//NUMA模式下工作线程不会窃取其他节点的队列，优先唤醒有队列等待的节点上的线程
+			for (i=0;i<m->count;i++) {
+				int id = (start + i) % m->count;
+				if (m->park[id].state == PARK_SLEEP && skynet_globalmq_pending(m->node[id])
+					&& park_wakeup(&m->park[id])) {
+					m->next = id + 1;
+					return;
+				}
+			}
+		}
+		for (i=0;i<m->count;i++) {
+			int id = (start + i) % m->count;
+			if (park_wakeup(&m->park[id])) {
+				m->next = id + 1;
+				return;
+			}
+		}
+	}
+}
+
+//全局队列中是否有服务在排队
+static int
+globalmq_busy() {
+	int depth[MQ_PRIORITY_COUNT];
+	skynet_globalmq_depth(depth);
+	int i;
+	for (i=0;i<MQ_PRIORITY_COUNT;i++) {
+		if (depth[i] > 0)
+			return 1;
 	}
+	return 0;
 }
 
 //socket 线程
 static void *
 thread_socket(void *p) {
-	struct monitor * m = p;
+	struct socket_parm *sp = p;
+	struct monitor * m = sp->m;
 	skynet_initthread(THREAD_SOCKET);
+	//多个socket线程时各自绑定一个cpu
+	cpuset_bind(&m->socket_cpu, m->socket_thread > 1 ? sp->id : -1);
 	for (;;) {
-		int r = skynet_socket_poll();
+		int r = skynet_socket_poll(sp->id);
 		if (r==0)
 			break;
 		if (r<0) {
@@ -91,9 +327,10 @@ free_monitor(struct monitor *m) {
 	int n = m->count;
 	for (i=0;i<n;i++) {
 		skynet_monitor_delete(m->m[i]);
+		park_destroy(&m->park[i]);
 	}
-	pthread_mutex_destroy(&m->mutex);
-	pthread_cond_destroy(&m->cond);
+	skynet_free(m->node);
+	skynet_free(m->park);
 	skynet_free(m->m);
 	skynet_free(m);
 }
@@ -141,11 +378,19 @@ static void *
 thread_timer(void *p) {
 	struct monitor * m = p;
 	skynet_initthread(THREAD_TIMER);
+	cpuset_bind(&m->timer_cpu, -1);
+	uint32_t interval = skynet_timer_interval() / 4; //有消息排队时每个tick检查4次
 	for (;;) {
-		skynet_updatetime();
+		int fired = skynet_updatetime();
 		CHECK_ABORT
-		wakeup(m,m->count-1); //只要有挂起的线程，就唤醒一个
-		usleep(2500); //挂起2.5毫秒
+		int busy = globalmq_busy();
+		if (fired || busy) {
+			wakeup(m,m->count-1); //只要有挂起的线程，就唤醒一个
+		}
+		// a running worker pushes messages without waking anyone, so poll every quarter
+		// tick while some workers are parked and others may push work for them
+		int parked = m->sleep > 0 && m->sleep < m->count;
+		skynet_timer_sleep((busy || parked) ? interval : TIMER_IDLE_WAIT);
 		if (SIG) {
 			signal_hup();
 			SIG = 0;
@@ -155,10 +400,12 @@ thread_timer(void *p) {
 	skynet_socket_exit();
 	// wakeup all worker thread
 	//标记退出，唤醒所有工作线程，使工作线程结束循环
-	pthread_mutex_lock(&m->mutex);
 	m->quit = 1; 
-	pthread_cond_broadcast(&m->cond);
-	pthread_mutex_unlock(&m->mutex);
+	__sync_synchronize();
+	int i;
+	for (i=0;i<m->count;i++) {
+		park_wakeup(&m->park[i]);
+	}
 	return NULL;
 }
 
@@ -171,23 +418,24 @@ thread_worker(void *p) {
 	struct monitor *m = wp->m;
 	struct skynet_monitor *sm = m->m[id];
 	skynet_initthread(THREAD_WORKER);
+	cpuset_bind(&m->worker_cpu, id);
+	skynet_globalmq_bind(id);
 	struct message_queue * q = NULL;
 	while (!m->quit) {
 		//分发消息，没消息处理就挂起
 		q = skynet_context_message_dispatch(sm, q, weight);
 		if (q == NULL) {
-			if (pthread_mutex_lock(&m->mutex) == 0) {
-				++ m->sleep;
-				// "spurious wakeup" is harmless,
-				// because skynet_context_message_dispatch() can be call at any time.
-				if (!m->quit)
-					pthread_cond_wait(&m->cond, &m->mutex); //挂起当前线程，等待条件，并解锁互斥量。当被唤醒返回时，再次锁住互斥量
-				-- m->sleep;
-				if (pthread_mutex_unlock(&m->mutex)) {
-					fprintf(stderr, "unlock mutex error");
-					exit(1);
-				}
-			}
+			struct park_slot *p = &m->park[id];
+			p->state = PARK_SLEEP;
+			ATOM_INC(&m->sleep);
+			// A queue pushed after the dispatch above, but before sleep is increased, doesn't
+			// wake anyone (wakeup() only sees the old sleep count), so check again.
+			// "spurious wakeup" is harmless,
+			// because skynet_context_message_dispatch() can be call at any time.
+			if (!m->quit && !globalmq_busy())
+				park_wait(p); //挂起当前线程，直到被指定唤醒
+			p->state = PARK_RUNNING;
+			ATOM_DEC(&m->sleep);
 		}
 	}
 	return NULL;
@@ -195,32 +443,54 @@ thread_worker(void *p) {
 
 //开启线程
 static void
-start(int thread) {
-	pthread_t pid[thread+3]; //skynet的线程数组，thread为工作线程数，外加 时钟线程 监视器线程 socket线程
+start(struct skynet_config * config) {
+	int thread = config->thread;
+	int socket_thread = config->socket_thread;
+	pthread_t pid[thread+2+socket_thread]; //skynet的线程数组，thread为工作线程数，外加 时钟线程 监视器线程 socket线程
 
 	struct monitor *m = skynet_malloc(sizeof(*m));
 	memset(m, 0, sizeof(*m));
 	m->count = thread; //工作线程的数量
+	m->socket_thread = socket_thread;
 	m->sleep = 0;
 
 	//为每个工作线程有一个监测器
 	m->m = skynet_malloc(thread * sizeof(struct skynet_monitor *));
+	m->park = skynet_malloc(thread * sizeof(struct park_slot));
 	int i;
 	for (i=0;i<thread;i++) {
 		m->m[i] = skynet_monitor_new(); //指针指向skynet_monitor
+		park_init(&m->park[i]); //每个工作线程一个挂起槽
 	}
-	if (pthread_mutex_init(&m->mutex, NULL)) { //初始化互斥锁
-		fprintf(stderr, "Init mutex error");
-		exit(1);
-	}
-	if (pthread_cond_init(&m->cond, NULL)) { //初始化条件变量
-		fprintf(stderr, "Init cond error");
-		exit(1);
+
+	cpuset_parse(&m->worker_cpu, config->worker_cpu);
+	cpuset_parse(&m->socket_cpu, config->socket_cpu);
+	cpuset_parse(&m->timer_cpu, config->timer_cpu);
+	if (config->numa) {
+		//NUMA模式下工作线程必须绑定cpu，没有指定时依次绑定到所有cpu
+		if (m->worker_cpu.n == 0) {
+			int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+			for (i=0;i<ncpu && i<CPUSET_MAX;i++) {
+				m->worker_cpu.cpu[i] = i;
+			}
+			m->worker_cpu.n = i;
+		}
+		m->node = skynet_malloc(thread * sizeof(int));
+		for (i=0;i<thread;i++) {
+			m->node[i] = cpu_node(m->worker_cpu.cpu[i % m->worker_cpu.n]);
+		}
+		skynet_mq_numa(thread, m->node);
 	}
 
 	create_thread(&pid[0], thread_monitor, m); //创建monitor线程
 	create_thread(&pid[1], thread_timer, m); //创建timer线程
-	create_thread(&pid[2], thread_socket, m); //创建socket线程
+	//创建socket_thread个socket线程
+	struct socket_parm sp[socket_thread];
+	for (i=0;i<socket_thread;i++) {
+		sp[i].m = m;
+		sp[i].id = i;
+		create_thread(&pid[i+2], thread_socket, &sp[i]);
+	}
 
 	//创建thread个工作线程
 	static int weight[] = { 
@@ -237,11 +507,11 @@ start(int thread) {
 		} else {
 			wp[i].weight = 0;
 		}
-		create_thread(&pid[i+3], thread_worker, &wp[i]);
+		create_thread(&pid[i+2+socket_thread], thread_worker, &wp[i]);
 	}
 
-	//对非工作线程的三个线程进行回收
-	for (i=0;i<thread+3;i++) {
+	//回收所有线程
+	for (i=0;i<thread+2+socket_thread;i++) {
 		pthread_join(pid[i], NULL); 
 	}
 
@@ -285,11 +555,19 @@ skynet_start(struct skynet_config * config) {
 	}
 	skynet_harbor_init(config->harbor); //初始化harbor
 	skynet_handle_init(config->harbor); //初始化服务地址管理
-	skynet_mq_init(); //初始化消息队列
+	skynet_mq_init(config->worksteal || config->numa ? config->thread : 0); //初始化消息队列
+	if (config->handoff) {
+		skynet_mq_handoff(config->thread); //worker直接调度被请求唤醒的服务
+	}
+	skynet_globalmq_policy(config->strict_priority);
 	skynet_module_init(config->module_path); //初始化服务模块
-	skynet_timer_init(); //初始化时钟
-	skynet_socket_init(); //初始化socket
+	skynet_timer_init(config->timer_resolution, config->thread); //初始化时钟
+	if (config->socket_thread < 1) {
+		config->socket_thread = 1;
+	}
+	skynet_socket_init(config->socket_thread, config->socket_direct_write); //初始化socket，每个socket线程一个epoll
 	skynet_profile_enable(config->profile); //是否其中skynet统计
+	skynet_dispatch_quantum(config->quantum); //自适应调度的时间预算
 
 	//创建logger服务 skynet的第一个服务
 	struct skynet_context *ctx = skynet_context_new(config->logservice, config->logger);
@@ -301,7 +579,7 @@ skynet_start(struct skynet_config * config) {
 	//skynet的启动服务 skynet的第二个服务
 	bootstrap(ctx, config->bootstrap);
 
-	start(config->thread);
+	start(config);
 
 	// harbor_exit may call socket send, so it should exit before socket_free
 	skynet_harbor_exit();
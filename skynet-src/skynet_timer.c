@@ -11,6 +11,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
 
 #if defined(__APPLE__)
 #include <sys/time.h>
@@ -18,6 +21,11 @@
 #include <mach/mach.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#define TIMER_FD
+#endif
+
 typedef void (*timer_execute_func)(void *ud,void *arg);
 
 #define TIME_NEAR_SHIFT 8
@@ -27,56 +35,182 @@ typedef void (*timer_execute_func)(void *ud,void *arg);
 #define TIME_NEAR_MASK (TIME_NEAR-1) //255
 #define TIME_LEVEL_MASK (TIME_LEVEL-1) //63
 
+#define NANOSEC 1000000000
+#define MICROSEC 1000000
+
+// 默认每秒 100 个 tick (1/100 秒)，最高 1000 (1 毫秒)
+#define TIME_RESOLUTION 100
+#define TIME_RESOLUTION_MAX 1000
+
 struct timer_event {
 	uint32_t handle;
 	int session;
 };
 
+#define TIME_HASH_SIZE 1024
+#define TIME_GROUP_SIZE 64 //一个合并节点最多容纳的定时器数
+#define TIME_GROUP_SLOT TIME_NEAR
+
 struct timer_node {
 	struct timer_node *next; //
+	struct timer_node *prev; //双向循环链表，取消时直接摘除
+	struct timer_node *hash_next; //按 handle 和 session 索引，用于取消
+	struct timer_node **hash_prev;
 	uint32_t expire; //有效期
+	uint32_t group; //0: 单个定时器；否则是合并节点，后面跟着 group 个 timer_event
 };
 
+//带哨兵的循环链表，空链表时 head.next == &head
 struct link_list {
 	struct timer_node head;
-	struct timer_node *tail;
 };
 
-struct timer {
+//时间轮按服务地址分片，每个分片有自己的锁，timer线程每个tick依次推进所有分片
+struct timer_wheel {
 	struct link_list near[TIME_NEAR];
 	struct link_list t[4][TIME_LEVEL];
 	struct spinlock lock; //自旋锁
 	uint32_t time; //时间
+	uint64_t point; //时间轮已经走到的时间点，单位tick
+	uint64_t near_bits[TIME_NEAR / 64]; //near中可能非空的槽，用于找下一个到期时间
+	struct timer_node **hash; //时间轮里所有的节点
+	int hash_size;
+	int hash_count;
+	struct timer_node *group[TIME_GROUP_SLOT]; //按到期tick找还没满的合并节点
+	int groups; //时间轮里的合并节点数
+};
+
+struct timer {
+	struct timer_wheel *wheel; //分片
+	int wheels; //分片数，2的幂
 	uint32_t starttime; //进程启动的时间戳， 单位秒
-	uint64_t current; //进程运行的时间 单位skynet单位
-	uint64_t current_point; //当前时间点， 单位1/100秒
+	uint64_t current; //进程运行的时间 单位tick
+	uint64_t current_point; //当前时间点， 单位tick
+	uint64_t origin; //current为0的时间点，skynet_now由它算出
+	uint64_t deadline; //timer线程下次醒来的时间，单位纳秒
+	int fired; //有超时消息派发出去
+	uint32_t skew; //timer线程醒晚了(或时钟回退)的次数
+	uint32_t skew_max; //醒晚的最大tick数
+	uint32_t resolution; //每秒的tick数
+	uint32_t tick_ns; //每个tick的纳秒数
+#ifdef TIMER_FD
+	int tfd; //timer线程睡在上面，到deadline醒来
+#endif
+	struct spinlock arm; //修改deadline并设置timerfd
 };
 
 static struct timer * TI = NULL; //全局时间结构体
 
+static inline void
+link_init(struct link_list *list) {
+	list->head.next = list->head.prev = &list->head;
+}
+
+//取下整个链表，返回以 NULL 结尾的单链表
 static inline struct timer_node *
 link_clear(struct link_list *list) {
 	struct timer_node * ret = list->head.next;
-	list->head.next = 0;
-	list->tail = &(list->head);
+	if (ret == &list->head)
+		return NULL;
+	list->head.prev->next = NULL;
+	link_init(list);
 
 	return ret;
 }
 
+static inline int
+link_empty(struct link_list *list) {
+	return list->head.next == &list->head;
+}
+
+static inline void
+link_node(struct link_list *list,struct timer_node *node) {
+	node->prev = list->head.prev;
+	node->next = &list->head;
+	list->head.prev->next = node;
+	list->head.prev = node;
+}
+
 static inline void
-link(struct link_list *list,struct timer_node *node) {
-	list->tail->next = node;
-	list->tail = node;
-	node->next=0;
+link_remove(struct timer_node *node) {
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+}
+
+static inline struct timer_node **
+hash_slot(struct timer_wheel *W, uint32_t handle, int session) {
+	uint32_t h = (handle * 2654435761u) ^ (uint32_t)session;
+	return &W->hash[h & (W->hash_size - 1)];
+}
+
+static inline void
+hash_link(struct timer_node **slot, struct timer_node *node) {
+	node->hash_next = *slot;
+	node->hash_prev = slot;
+	if (*slot)
+		(*slot)->hash_prev = &node->hash_next;
+	*slot = node;
+}
+
+static void
+hash_expand(struct timer_wheel *W) {
+	struct timer_node **old = W->hash;
+	int old_size = W->hash_size;
+	W->hash_size *= 2;
+	W->hash = skynet_malloc(W->hash_size * sizeof(struct timer_node *));
+	memset(W->hash, 0, W->hash_size * sizeof(struct timer_node *));
+	int i;
+	for (i=0;i<old_size;i++) {
+		struct timer_node *node = old[i];
+		while (node) {
+			struct timer_node *next = node->hash_next;
+			struct timer_event *event = (struct timer_event *)(node+1);
+			hash_link(hash_slot(W, event->handle, event->session), node);
+			node = next;
+		}
+	}
+	skynet_free(old);
+}
+
+static void
+hash_insert(struct timer_wheel *W, struct timer_node *node) {
+	if (W->hash_count >= W->hash_size) {
+		hash_expand(W);
+	}
+	struct timer_event *event = (struct timer_event *)(node+1);
+	hash_link(hash_slot(W, event->handle, event->session), node);
+	++W->hash_count;
+}
+
+static inline void
+hash_remove(struct timer_wheel *W, struct timer_node *node) {
+	*node->hash_prev = node->hash_next;
+	if (node->hash_next)
+		node->hash_next->hash_prev = node->hash_prev;
+	--W->hash_count;
+}
+
+static struct timer_node *
+hash_find(struct timer_wheel *W, uint32_t handle, int session) {
+	struct timer_node *node = *hash_slot(W, handle, session);
+	while (node) {
+		struct timer_event *event = (struct timer_event *)(node+1);
+		if (event->handle == handle && event->session == session)
+			return node;
+		node = node->hash_next;
+	}
+	return NULL;
 }
 
 static void
-add_node(struct timer *T,struct timer_node *node) {
+add_node(struct timer_wheel *W,struct timer_node *node) {
 	uint32_t time=node->expire;
-	uint32_t current_time=T->time;
+	uint32_t current_time=W->time;
 	
 	if ((time|TIME_NEAR_MASK)==(current_time|TIME_NEAR_MASK)) {
-		link(&T->near[time&TIME_NEAR_MASK],node);
+		int idx = time&TIME_NEAR_MASK;
+		link_node(&W->near[idx],node);
+		W->near_bits[idx >> 6] |= (uint64_t)1 << (idx & 63);
 	} else {
 		int i;
 		uint32_t mask=TIME_NEAR << TIME_LEVEL_SHIFT;
@@ -87,39 +221,118 @@ add_node(struct timer *T,struct timer_node *node) {
 			mask <<= TIME_LEVEL_SHIFT;
 		}
 
-		link(&T->t[i][((time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK)],node);	
+		link_node(&W->t[i][((time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK)],node);	
+	}
+}
+
+static uint64_t gettime();
+
+//timer线程在deadline醒来，只会提前，不会推后
+static void
+timer_arm(struct timer *T, uint64_t deadline) {
+	spinlock_lock(&T->arm);
+	if (deadline < T->deadline) {
+		T->deadline = deadline;
+#ifdef TIMER_FD
+		if (T->tfd >= 0) {
+			struct itimerspec its;
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec = deadline / NANOSEC;
+			its.it_value.tv_nsec = deadline % NANOSEC;
+			timerfd_settime(T->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+		}
+#endif
+	}
+	spinlock_unlock(&T->arm);
+}
+
+static inline struct timer_wheel *
+timer_wheel(struct timer *T, uint32_t handle) {
+	return &T->wheel[handle & (T->wheels - 1)];
+}
+
+// The wheel is behind the clock while the timer thread sleeps,
+// count the expire from the clock, or it would fire early.
+static inline uint32_t
+timer_expire(struct timer_wheel *W, uint64_t now, int time) {
+	uint32_t lag = now > W->point ? (uint32_t)(now - W->point) : 0;
+	return time+lag+W->time;
+}
+
+// T->deadline is reset to the max before the timer thread looks for
+// the next expire in the wheels, so a node it misses is armed here.
+static inline void
+timer_wake(struct timer *T, uint64_t now, int time) {
+	uint64_t deadline = (now + time) * T->tick_ns;
+	if (deadline < T->deadline) {
+		timer_arm(T, deadline);
 	}
 }
 
 static void
-timer_add(struct timer *T,void *arg,size_t sz,int time) {
-	struct timer_node *node = (struct timer_node *)skynet_malloc(sizeof(*node)+sz);
-	memcpy(node+1,arg,sz);
+timer_add(struct timer *T,struct timer_event *event,int time) {
+	struct timer_node *node = (struct timer_node *)skynet_malloc(sizeof(*node)+sizeof(*event));
+	memcpy(node+1,event,sizeof(*event));
+	node->group = 0;
+
+	struct timer_wheel *W = timer_wheel(T, event->handle);
+	uint64_t now = gettime();
+
+	SPIN_LOCK(W);
+
+		node->expire=timer_expire(W, now, time);
+		add_node(W,node);
+		hash_insert(W,node);
+
+	SPIN_UNLOCK(W);
+
+	timer_wake(T, now, time);
+}
 
-	SPIN_LOCK(T);
+//同一个tick到期的定时器合并到一个节点里，节点满了再开一个新的
+//合并的定时器不在hash里，不能从时间轮里取消
+static void
+timer_add_group(struct timer *T,struct timer_event *event,int time) {
+	struct timer_wheel *W = timer_wheel(T, event->handle);
+	uint64_t now = gettime();
+
+	SPIN_LOCK(W);
+
+		uint32_t expire = timer_expire(W, now, time);
+		struct timer_node **slot = &W->group[expire & (TIME_GROUP_SLOT-1)];
+		struct timer_node *node = *slot;
+		if (node == NULL || node->expire != expire || node->group == TIME_GROUP_SIZE) {
+			node = (struct timer_node *)skynet_malloc(sizeof(*node)+TIME_GROUP_SIZE*sizeof(*event));
+			node->expire = expire;
+			node->group = 0;
+			add_node(W,node);
+			*slot = node;
+			++W->groups;
+		}
+		struct timer_event *e = (struct timer_event *)(node+1);
+		e[node->group++] = *event;
 
-		node->expire=time+T->time;
-		add_node(T,node);
+	SPIN_UNLOCK(W);
 
-	SPIN_UNLOCK(T);
+	timer_wake(T, now, time);
 }
 
 static void
-move_list(struct timer *T, int level, int idx) {
-	struct timer_node *current = link_clear(&T->t[level][idx]);
+move_list(struct timer_wheel *W, int level, int idx) {
+	struct timer_node *current = link_clear(&W->t[level][idx]);
 	while (current) {
 		struct timer_node *temp=current->next;
-		add_node(T,current);
+		add_node(W,current);
 		current=temp;
 	}
 }
 
 static void
-timer_shift(struct timer *T) {
+timer_shift(struct timer_wheel *W) {
 	int mask = TIME_NEAR;
-	uint32_t ct = ++T->time;
+	uint32_t ct = ++W->time;
 	if (ct == 0) {
-		move_list(T, 3, 0);
+		move_list(W, 3, 0);
 	} else {
 		uint32_t time = ct >> TIME_NEAR_SHIFT;
 		int i=0;
@@ -127,7 +340,7 @@ timer_shift(struct timer *T) {
 		while ((ct & (mask-1))==0) {
 			int idx=time & TIME_LEVEL_MASK;
 			if (idx!=0) {
-				move_list(T, i, idx);
+				move_list(W, i, idx);
 				break;				
 			}
 			mask <<= TIME_LEVEL_SHIFT;
@@ -137,84 +350,169 @@ timer_shift(struct timer *T) {
 	}
 }
 
+#define DISPATCH_BATCH 32
+
+struct dispatch_batch {
+	struct skynet_message message[DISPATCH_BATCH];
+	uint32_t handle;
+	int n;
+};
+
+//连续发往同一个服务的超时消息合并成一次批量压入
+static inline void
+dispatch_event(struct dispatch_batch *b, struct timer_event *event) {
+	if (b->n == DISPATCH_BATCH || (b->n > 0 && event->handle != b->handle)) {
+		skynet_context_push_batch(b->handle, b->message, b->n);
+		b->n = 0;
+	}
+	struct skynet_message *m = &b->message[b->n++];
+	b->handle = event->handle;
+	m->source = 0;
+	m->session = event->session;
+	m->data = NULL;
+	m->sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+}
+
 //分发列表, 入队列
 static inline void
 dispatch_list(struct timer_node *current) {
+	struct dispatch_batch b;
+	b.handle = 0;
+	b.n = 0;
 	do {
 		struct timer_event * event = (struct timer_event *)(current+1);
-		struct skynet_message message;
-		message.source = 0;
-		message.session = event->session;
-		message.data = NULL;
-		message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+		if (current->group == 0) {
+			dispatch_event(&b, event);
+		} else {
+			uint32_t i;
+			for (i=0;i<current->group;i++) {
+				dispatch_event(&b, &event[i]);
+			}
+		}
 
-		skynet_context_push(event->handle, &message);
-		
 		struct timer_node * temp = current;
 		current=current->next;
 		skynet_free(temp);	
 	} while (current);
+	skynet_context_push_batch(b.handle, b.message, b.n);
 }
 
 static inline void
-timer_execute(struct timer *T) {
-	int idx = T->time & TIME_NEAR_MASK;
+timer_execute(struct timer_wheel *W) {
+	int idx = W->time & TIME_NEAR_MASK;
+	W->near_bits[idx >> 6] &= ~((uint64_t)1 << (idx & 63));
 	
-	while (T->near[idx].head.next) {
-		struct timer_node *current = link_clear(&T->near[idx]);
-		SPIN_UNLOCK(T);
+	while (!link_empty(&W->near[idx])) {
+		struct timer_node *current = link_clear(&W->near[idx]);
+		// can't be canceled after leaving the wheel
+		struct timer_node *node;
+		for (node = current; node; node = node->next) {
+			if (node->group == 0) {
+				hash_remove(W, node);
+			} else {
+				struct timer_node **slot = &W->group[node->expire & (TIME_GROUP_SLOT-1)];
+				if (*slot == node)
+					*slot = NULL;
+				--W->groups;
+			}
+		}
+		TI->fired = 1;
+		SPIN_UNLOCK(W);
 		// dispatch_list don't need lock T
 		dispatch_list(current);
-		SPIN_LOCK(T);
+		SPIN_LOCK(W);
 	}
 }
 
-//单个时间单位更新
-static void 
-timer_update(struct timer *T) {
-	SPIN_LOCK(T);
-
-	// try to dispatch timeout 0 (rare condition)
-	timer_execute(T);
+static int next_expire(struct timer_wheel *W);
 
-	// shift time first, and then dispatch timer message
-	timer_shift(T);
+//时间轮前进n个tick，只锁一次
+//near里没有节点、也不用从高层移下节点的tick直接跳过
+static void
+wheel_update(struct timer_wheel *W, uint32_t n) {
+	SPIN_LOCK(W);
 
-	timer_execute(T);
+	// try to dispatch timeout 0 (rare condition)
+	timer_execute(W);
+
+	while (n > 0) {
+		uint32_t skip = n;
+		if (W->hash_count > 0 || W->groups > 0) {
+			// nothing to do until the next expire in near, or the end of near
+			uint32_t next = next_expire(W) - 1;
+			if (next < skip)
+				skip = next;
+		}
+		W->time += skip;
+		W->point += skip;
+		n -= skip;
+		if (n == 0)
+			break;
+
+		// shift time first, and then dispatch timer message
+		timer_shift(W);
+		++W->point;
+		--n;
+
+		timer_execute(W);
+	}
 
-	SPIN_UNLOCK(T);
+	SPIN_UNLOCK(W);
 }
 
-//创建skynet时间
-static struct timer *
-timer_create_timer() {
-	//指向timer结构的指针，并初始化
-	struct timer *r=(struct timer *)skynet_malloc(sizeof(struct timer));
-	memset(r,0,sizeof(*r));
+static void 
+timer_update(struct timer *T, uint32_t n) {
+	int i;
+	for (i=0;i<T->wheels;i++) {
+		wheel_update(&T->wheel[i], n);
+	}
+}
 
+static void
+wheel_init(struct timer_wheel *W) {
 	int i,j;
 
 	//初始化数组
 	for (i=0;i<TIME_NEAR;i++) {
-		link_clear(&r->near[i]);
+		link_init(&W->near[i]);
 	}
 
 	//初始化二维数组
 	for (i=0;i<4;i++) {
 		for (j=0;j<TIME_LEVEL;j++) {
-			link_clear(&r->t[i][j]);
+			link_init(&W->t[i][j]);
 		}
 	}
 
-	SPIN_INIT(r) //初始化自旋锁
+	W->hash_size = TIME_HASH_SIZE;
+	W->hash = skynet_malloc(W->hash_size * sizeof(struct timer_node *));
+	memset(W->hash, 0, W->hash_size * sizeof(struct timer_node *));
+
+	SPIN_INIT(W) //初始化自旋锁
+}
+
+//创建skynet时间
+static struct timer *
+timer_create_timer(int wheels) {
+	//指向timer结构的指针，并初始化
+	struct timer *r=(struct timer *)skynet_malloc(sizeof(struct timer));
+	memset(r,0,sizeof(*r));
+
+	r->wheels = wheels;
+	r->wheel = skynet_malloc(wheels * sizeof(struct timer_wheel));
+	memset(r->wheel, 0, wheels * sizeof(struct timer_wheel));
+	int i;
+	for (i=0;i<wheels;i++) {
+		wheel_init(&r->wheel[i]);
+	}
 
 	r->current = 0;
 
 	return r;
 }
 
-int
-skynet_timeout(uint32_t handle, int time, int session) {
+static int
+timeout(uint32_t handle, int time, int session) {
 	if (time <= 0) {
 		struct skynet_message message;
 		message.source = 0;
@@ -229,63 +527,194 @@ skynet_timeout(uint32_t handle, int time, int session) {
 		struct timer_event event;
 		event.handle = handle;
 		event.session = session;
-		timer_add(TI, &event, sizeof(event), time);
+		timer_add(TI, &event, time);
+	}
+
+	return session;
+}
+
+//从时间轮中取消一个还没有到期的定时器，返回0表示取消成功
+//返回-1表示找不到，它可能已经到期，超时消息已经(或即将)压入服务的消息队列
+int
+skynet_timeout_cancel(uint32_t handle, int session) {
+	struct timer_wheel *W = timer_wheel(TI, handle);
+	SPIN_LOCK(W);
+	struct timer_node *node = hash_find(W, handle, session);
+	if (node) {
+		link_remove(node);
+		hash_remove(W, node);
 	}
+	SPIN_UNLOCK(W);
+	if (node == NULL)
+		return -1;
+	skynet_free(node);
+	return 0;
+}
+
+// 把 unit 分之一秒换算成 tick ，向上取整，超时不会提前
+static inline int
+to_tick(int time, int unit) {
+	if (time <= 0)
+		return time;
+	uint64_t t = ((uint64_t)time * TI->resolution + unit - 1) / unit;
+	return t > INT_MAX ? INT_MAX : (int)t;
+}
+
+// time 单位 1/100 秒
+int
+skynet_timeout(uint32_t handle, int time, int session) {
+	return timeout(handle, to_tick(time, 100), session);
+}
 
+int
+skynet_timeout_ms(uint32_t handle, int time, int session) {
+	return timeout(handle, to_tick(time, 1000), session);
+}
+
+//大量服务使用同样的超时(比如心跳)时，同一个tick到期的定时器共用一个节点
+//time 单位 1/100 秒
+int
+skynet_timeout_group(uint32_t handle, int time, int session) {
+	time = to_tick(time, 100);
+	if (time <= 0)
+		return timeout(handle, time, session);
+	struct timer_event event;
+	event.handle = handle;
+	event.session = session;
+	timer_add_group(TI, &event, time);
 	return session;
 }
 
-// centisecond: 1/100 second
-//获取系统时间，精度为百分之一秒
+//获取系统时间，精度为一个tick
 static void
-systime(uint32_t *sec, uint32_t *cs) {
+systime(uint32_t *sec, uint32_t *tick) {
 #if !defined(__APPLE__)
 	struct timespec ti;
 	clock_gettime(CLOCK_REALTIME, &ti);
 	*sec = (uint32_t)ti.tv_sec;
-	*cs = (uint32_t)(ti.tv_nsec / 10000000);
+	*tick = (uint32_t)(ti.tv_nsec / TI->tick_ns);
 #else
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
 	*sec = tv.tv_sec;
-	*cs = tv.tv_usec / 10000;
+	*tick = (uint32_t)((uint64_t)tv.tv_usec * 1000 / TI->tick_ns);
 #endif
 }
 
-//获取skynet的时间戳
+//获取skynet的时间戳，单位tick
 static uint64_t
 gettime() {
 	uint64_t t;
 #if !defined(__APPLE__)
 	struct timespec ti;
 	clock_gettime(CLOCK_MONOTONIC, &ti);
-	t = (uint64_t)ti.tv_sec * 100;
-	t += ti.tv_nsec / 10000000;
+	t = (uint64_t)ti.tv_sec * TI->resolution;
+	t += ti.tv_nsec / TI->tick_ns;
 #else
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
-	t = (uint64_t)tv.tv_sec * 100;
-	t += tv.tv_usec / 10000;
+	t = (uint64_t)tv.tv_sec * TI->resolution;
+	t += (uint64_t)tv.tv_usec * 1000 / TI->tick_ns;
 #endif
 	return t;
 }
 
-//更新时间
-void
+//timer线程应该醒来的tick
+static uint64_t
+wake_point(struct timer *T) {
+#ifdef TIMER_FD
+	if (T->tfd >= 0 && T->deadline != UINT64_MAX) {
+		return T->deadline / T->tick_ns;
+	}
+#endif
+	return T->current_point + 1;
+}
+
+//更新时间，返回是否有超时消息派发出去
+int
 skynet_updatetime(void) {
 	uint64_t cp = gettime();
+	uint64_t wake = wake_point(TI);
+	if (cp > wake + 1) {
+		// the timer thread is descheduled (or the process is stopped)
+		uint64_t lag = cp - wake;
+		++TI->skew;
+		if (lag > TI->skew_max)
+			TI->skew_max = lag > UINT32_MAX ? UINT32_MAX : (uint32_t)lag;
+	}
 	if(cp < TI->current_point) {
+		++TI->skew;
 		skynet_error(NULL, "time diff error: change from %lld to %lld", cp, TI->current_point);
 		TI->current_point = cp;
+		TI->origin = cp - TI->current;
+		int i;
+		for (i=0;i<TI->wheels;i++) {
+			struct timer_wheel *W = &TI->wheel[i];
+			SPIN_LOCK(W);
+			W->point = cp;
+			SPIN_UNLOCK(W);
+		}
 	} else if (cp != TI->current_point) {
 		uint32_t diff = (uint32_t)(cp - TI->current_point);
 		TI->current_point = cp;
 		TI->current += diff;
+		timer_update(TI, diff);
+	}
+	int fired = TI->fired;
+	TI->fired = 0;
+	return fired;
+}
+
+//距离下一个可能到期的tick数，最远到near的末尾，那时高层的节点会移到near里
+static int
+next_expire(struct timer_wheel *W) {
+	int current = W->time & TIME_NEAR_MASK;
+	int i = current + 1;
+	while (i < TIME_NEAR) {
+		uint64_t bits = W->near_bits[i >> 6] >> (i & 63);
+		if (bits) {
+			return i + __builtin_ctzll(bits) - current;
+		}
+		i = (i | 63) + 1;
+	}
+	return TIME_NEAR - current;
+}
+
+//timer线程睡到下一个定时器到期，最多max微秒，期间新加入的更早的定时器会提前唤醒它
+void
+skynet_timer_sleep(uint32_t max) {
+	struct timer *T = TI;
+#ifdef TIMER_FD
+	if (T->tfd >= 0) {
+		struct timespec ti;
+		clock_gettime(CLOCK_MONOTONIC, &ti);
+		uint64_t deadline = (uint64_t)ti.tv_sec * NANOSEC + ti.tv_nsec + (uint64_t)max * 1000;
+		// reset first, the nodes added after a wheel is checked are armed by timer_add
+		spinlock_lock(&T->arm);
+		T->deadline = UINT64_MAX;
+		spinlock_unlock(&T->arm);
 		int i;
-		for (i=0;i<diff;i++) {
-			timer_update(TI);
+		for (i=0;i<T->wheels;i++) {
+			struct timer_wheel *W = &T->wheel[i];
+			SPIN_LOCK(W);
+			if (W->hash_count > 0 || W->groups > 0) {
+				uint64_t expire = (W->point + next_expire(W)) * T->tick_ns;
+				if (expire < deadline)
+					deadline = expire;
+			}
+			SPIN_UNLOCK(W);
 		}
+		timer_arm(T, deadline);
+		uint64_t expirations;
+		if (read(T->tfd, &expirations, sizeof(expirations)) < 0) {
+			// EINTR, check the time again
+		}
+		return;
 	}
+#endif
+	// no timerfd, poll 4 times each tick
+	uint32_t interval = T->tick_ns / 4000;
+	usleep(max < interval ? max : interval);
 }
 
 //进程启动的时间戳 单位秒
@@ -294,27 +723,65 @@ skynet_starttime(void) {
 	return TI->starttime;
 }
 
-//返回进程启动的运行的时间
+//返回进程启动的运行的时间，单位始终是1/100秒，和tick的精度无关
+//timer线程可能睡得比较久，所以直接读时钟
 uint64_t 
 skynet_now(void) {
-	return TI->current;
+	uint64_t cp = gettime();
+	uint64_t origin = TI->origin;
+	return (cp > origin ? cp - origin : 0) * 100 / TI->resolution;
+}
+
+//timer线程醒晚的次数，和最大的延迟，单位毫秒
+void
+skynet_timer_skew(uint32_t *count, uint32_t *max_lag) {
+	*count = TI->skew;
+	*max_lag = (uint32_t)((uint64_t)TI->skew_max * 1000 / TI->resolution);
+}
+
+//一个tick的微秒数
+uint32_t
+skynet_timer_interval(void) {
+	return TI->tick_ns / (NANOSEC / MICROSEC);
 }
 
 //时间初始化，将系统时间单位转换成skynet单位
+//resolution: 每秒的tick数, 需要能整除1000
+//worker: 工作线程数，时间轮的分片数是不小于它的2的幂
 void 
-skynet_timer_init(void) {
-	TI = timer_create_timer();
+skynet_timer_init(int resolution, int worker) {
+	if (resolution < TIME_RESOLUTION || resolution > TIME_RESOLUTION_MAX || TIME_RESOLUTION_MAX % resolution != 0) {
+		fprintf(stderr, "Invalid timer_resolution %d, use %d\n", resolution, TIME_RESOLUTION);
+		resolution = TIME_RESOLUTION;
+	}
+	int wheels = 1;
+	while (wheels < worker) {
+		wheels *= 2;
+	}
+	TI = timer_create_timer(wheels);
+	TI->resolution = resolution;
+	TI->tick_ns = NANOSEC / resolution;
 	uint32_t current = 0;
 	systime(&TI->starttime, &current);
 	TI->current = current;
 	TI->current_point = gettime();
+	int i;
+	for (i=0;i<wheels;i++) {
+		TI->wheel[i].point = TI->current_point;
+	}
+	TI->origin = TI->current_point - current;
+	TI->deadline = UINT64_MAX;
+#ifdef TIMER_FD
+	TI->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (TI->tfd < 0) {
+		fprintf(stderr, "timerfd_create failed, the timer thread polls instead\n");
+	}
+#endif
+	spinlock_init(&TI->arm);
 }
 
 // for profile
 
-#define NANOSEC 1000000000
-#define MICROSEC 1000000
-
 uint64_t
 skynet_thread_time(void) {
 #if  !defined(__APPLE__)
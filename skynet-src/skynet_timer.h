@@ -3,11 +3,18 @@
 
 #include <stdint.h>
 
-int skynet_timeout(uint32_t handle, int time, int session);
-void skynet_updatetime(void);
+int skynet_timeout(uint32_t handle, int time, int session);	// time in 1/100 second
+int skynet_timeout_ms(uint32_t handle, int time, int session);	// time in millisecond
+int skynet_timeout_group(uint32_t handle, int time, int session);	// time in 1/100 second, coalesced with the timers expire at the same tick, can't be canceled
+int skynet_timeout_cancel(uint32_t handle, int session);	// 0 : canceled, -1 : not found (maybe fired)
+int skynet_updatetime(void);	// return 1 when any timeout message is dispatched
+void skynet_timer_sleep(uint32_t max);	// sleep until the next timeout, at most max micro seconds
 uint32_t skynet_starttime(void);
 uint64_t skynet_thread_time(void);	// for profile, in micro second
 
-void skynet_timer_init(void);
+uint32_t skynet_timer_interval(void);	// micro seconds of one tick
+void skynet_timer_skew(uint32_t *count, uint32_t *max_lag);	// times the timer thread wakes up late, and the max lag in millisecond
+
+void skynet_timer_init(int resolution, int worker);	// ticks per second, and one timer wheel for each worker
 
 #endif
@@ -17,7 +17,7 @@ static poll_fd sp_create();
 static void sp_release(poll_fd fd);
 static int sp_add(poll_fd fd, int sock, void *ud);
 static void sp_del(poll_fd fd, int sock);
-static void sp_write(poll_fd, int sock, void *ud, bool enable);
+static void sp_enable(poll_fd, int sock, void *ud, bool read_enable, bool write_enable);
 static int sp_wait(poll_fd, struct event *e, int max);
 static void sp_nonblocking(int sock);
 
@@ -1,13 +1,17 @@
+#define _GNU_SOURCE	// for sendmmsg and recvmmsg
 #include "skynet.h"
 
 #include "socket_server.h"
 #include "socket_poll.h"
 #include "atomic.h"
+#include "spinlock.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
+#include <sched.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -15,6 +19,13 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#define CTRL_EVENTFD
+#define UDP_MMSG
+#endif
 
 #define MAX_INFO 128
 // MAX_SOCKET will be 2^MAX_SOCKET_P
@@ -55,6 +66,24 @@
 
 #define WARNING_SIZE (1024*1024)
 
+#define CTRL_RING_SIZE 1024 //每个poller的命令环大小，2的幂
+
+// 一次writev最多合并的缓存块数
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define MAX_IOV IOV_MAX
+#else
+#define MAX_IOV 1024
+#endif
+
+#define MAX_UDP_BATCH 64 //一次sendmmsg最多发送的udp包数
+
+//一次recvmmsg最多读取的udp包数
+#ifdef UDP_MMSG
+#define MAX_UDP_RECV 16
+#else
+#define MAX_UDP_RECV 1
+#endif
+
 //写缓存
 struct write_buffer {
 	struct write_buffer * next; //指向下一个缓存
@@ -85,27 +114,76 @@ struct socket {
 	uint16_t protocol; //socket协议类型，TCP/UDP
 	uint16_t type; //socket状态（读，写，监听，。。。）
 	int64_t warn_size;
+	bool reading; //是否监听读，目标服务饱和时暂停
+	struct socket *pause_prev; //暂停读取时挂在poller的paused链表上
+	struct socket *pause_next;
+	bool writing; //是否监听写
 	union {
 		int size;
 		uint8_t udp_address[UDP_ADDRESS_SIZE];
 	} p;
+	int sending; //命令环中还没处理的发送命令数，不为0时不能直接写
+	struct spinlock dw_lock; //工作线程直接写时持有，关闭fd前也要持有
+	const void * dw_buffer; //直接写剩下的部分，交给socket线程接着发送
+	int dw_size;
+	int dw_offset; //已经写出的字节数
 };
 
-//socket_server整体结构
-struct socket_server {
-	int recvctrl_fd; //管道的读取端
-	int sendctrl_fd; //管道的写入端
-	int checkctrl;   //标记是否检查管道
+union sockaddr_all {
+	struct sockaddr s;
+	struct sockaddr_in v4;
+	struct sockaddr_in6 v6;
+};
+
+// Commands are passed to the socket thread by a bounded MPSC ring. A producer
+// reserves a slot with an atomic increment of tail, waits until the slot is
+// free (seq == pos), copies the command and publishes it by seq = pos + 1. The
+// socket thread reads them in order from head. The eventfd only wakes up the
+// thread blocked in epoll, and only the producer which turns notify from 0 to 1
+// writes it, so a burst of commands costs one write and one read.
+
+//命令环中的一个命令
+struct ctrl_slot {
+	volatile uint32_t seq;
+	uint8_t type;
+	uint8_t len;
+	uint8_t buffer[256];
+};
+
+//一个socket线程的事件循环，每个socket线程有自己的epoll和命令环
+struct socket_poller {
+	int recvctrl_fd; //唤醒socket线程的eventfd (没有eventfd的平台是管道的读取端)
+	int sendctrl_fd; //eventfd，或者管道的写入端
+	int checkctrl;   //标记是否检查命令环
+	int notify; //已经(或正在)唤醒socket线程，其他生产者不用再写eventfd
+	uint32_t head; //socket线程读取的位置
+	uint32_t tail; //生产者预留的位置
+	struct ctrl_slot *ring; //命令环
 	poll_fd event_fd; //事件循环 poll文件描述符
-	int alloc_id; //分配的id
 	int event_n; //epoll 就绪的socket个数
 	int event_index; //当前处理的事件序号，从0开始
-	struct socket_object_interface soi;
+	struct socket *paused; //暂停读取的socket链表，恢复时不用扫描所有slot
 	struct event ev[MAX_EVENT]; //epoll就绪的事件数组
-	struct socket slot[MAX_SOCKET]; //socket数组，最多这么多数组
 	char buffer[MAX_INFO];
-	uint8_t udpbuffer[MAX_UDP_PACKAGE];
-	fd_set rfds; //对管道select时的文件描述符集合，在skynet中只对管道的读端感兴趣
+	uint8_t udpbuffer[MAX_UDP_RECV * MAX_UDP_PACKAGE]; //每个udp包一段
+	struct iovec iov[MAX_IOV]; //writev合并发送的缓存块
+#ifdef UDP_MMSG
+	struct mmsghdr msg[MAX_UDP_BATCH]; //sendmmsg合并发送的udp包
+	union sockaddr_all addr[MAX_UDP_BATCH];
+#endif
+	uint64_t send_syscall; //发送数据的系统调用次数
+	uint64_t send_message; //发送完的包数
+};
+
+//socket_server整体结构
+//socket数组是共享的，每个slot固定属于一个poller，只在那个poller的线程里读写
+struct socket_server {
+	int alloc_id; //分配的id
+	int poller_n; //socket线程数
+	int direct_write; //发送缓冲区为空时，工作线程直接写socket
+	struct socket_poller *poller;
+	struct socket_object_interface soi;
+	struct socket slot[MAX_SOCKET]; //socket数组，最多这么多数组
 };
 
 //客户端connect请求包
@@ -163,6 +241,11 @@ struct request_start {
 	uintptr_t opaque;
 };
 
+//恢复读取属于opaque的socket
+struct request_resume {
+	uintptr_t opaque;
+};
+
 struct request_setopt {
 	int id;
 	int what;
@@ -188,14 +271,15 @@ struct request_udp {
 	X Exit
 	D Send package (high)
 	P Send package (low)
+	W Send the rest of a direct write
 	A Send UDP package
 	T Set opt
 	U Create UDP socket
 	C set udp address
+	R Resume reading
  */
-//向管道中写入数据包
+//写入命令环的请求包
 struct request_package {
-	uint8_t header[8];	// 6 bytes dummy  header[6]==type 类型   head[7]==len 长度
 	union {
 		char buffer[256];
 		struct request_open open;
@@ -205,6 +289,7 @@ struct request_package {
 		struct request_listen listen;
 		struct request_bind bind;
 		struct request_start start;
+		struct request_resume resume;
 		struct request_setopt setopt;
 		struct request_udp udp;
 		struct request_setudp set_udp;
@@ -212,12 +297,6 @@ struct request_package {
 	uint8_t dummy[256];
 };
 
-union sockaddr_all {
-	struct sockaddr s;
-	struct sockaddr_in v4;
-	struct sockaddr_in6 v6;
-};
-
 //发送对象
 struct send_object {
 	void * buffer;
@@ -261,6 +340,17 @@ socket_keepalive(int fd) {
 	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&keepalive , sizeof(keepalive));  
 }
 
+//id所在slot属于的poller
+static inline struct socket_poller *
+id_poller(struct socket_server *ss, int id) {
+	return &ss->poller[HASH_ID(id) % ss->poller_n];
+}
+
+static inline struct socket_poller *
+socket_poller(struct socket_server *ss, struct socket *s) {
+	return &ss->poller[(s - ss->slot) % ss->poller_n];
+}
+
 //分配一个id，预留一个socket
 static int
 reserve_id(struct socket_server *ss) {
@@ -299,39 +389,94 @@ clear_wb_list(struct wb_list *list) {
 	list->tail = NULL;
 }
 
-//创建socket server 全节点唯一
-struct socket_server * 
-socket_server_create() {
-	int i;
+//创建poller的epoll、命令环和唤醒用的eventfd，失败返回-1
+static int
+poller_init(struct socket_poller *sp) {
 	int fd[2];
 	poll_fd efd = sp_create(); //创建poll
 	if (sp_invalid(efd)) {
 		fprintf(stderr, "socket-server: create event pool failed.\n");
-		return NULL;
+		return -1;
 	}
+#ifdef CTRL_EVENTFD
+	fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd[0] < 0) {
+		sp_release(efd);
+		fprintf(stderr, "socket-server: create eventfd failed.\n");
+		return -1;
+	}
+#else
 	//创建管道， fd[0]管道的读取端 fd[1]管道的写入端
 	if (pipe(fd)) {
 		sp_release(efd);
 		fprintf(stderr, "socket-server: create socket pair failed.\n");
-		return NULL;
+		return -1;
 	}
+	sp_nonblocking(fd[0]);
+#endif
 
 	//将读取端添加到事件循环列表中
 	if (sp_add(efd, fd[0], NULL)) {
 		// add recvctrl_fd to event poll
 		fprintf(stderr, "socket-server: can't add server fd to event pool.\n");
 		close(fd[0]);
-		close(fd[1]);
+		if (fd[1] != fd[0])
+			close(fd[1]);
 		sp_release(efd);
-		return NULL;
+		return -1;
 	}
 
+	sp->event_fd = efd;
+	sp->recvctrl_fd = fd[0];
+	sp->sendctrl_fd = fd[1];
+	sp->checkctrl = 1;
+	sp->notify = 0;
+	sp->head = 0;
+	sp->tail = 0;
+	sp->ring = MALLOC(CTRL_RING_SIZE * sizeof(struct ctrl_slot));
+	int i;
+	for (i=0;i<CTRL_RING_SIZE;i++) {
+		sp->ring[i].seq = i;
+	}
+	sp->event_n = 0;
+	sp->event_index = 0;
+	sp->paused = NULL;
+	sp->send_syscall = 0;
+	sp->send_message = 0;
+	return 0;
+}
+
+static void
+poller_release(struct socket_poller *sp) {
+	if (sp->sendctrl_fd != sp->recvctrl_fd)
+		close(sp->sendctrl_fd); //关闭管道写端
+	close(sp->recvctrl_fd);	//关闭eventfd(或管道读端)
+	sp_release(sp->event_fd); //销毁poll
+	FREE(sp->ring);
+}
+
+//创建socket server 全节点唯一
+//thread: socket线程数，每个线程一个poller
+struct socket_server * 
+socket_server_create(int thread) {
+	int i;
+	if (thread < 1) {
+		thread = 1;
+	}
+	struct socket_poller *poller = MALLOC(thread * sizeof(*poller));
+	for (i=0;i<thread;i++) {
+		if (poller_init(&poller[i])) {
+			while (--i >= 0) {
+				poller_release(&poller[i]);
+			}
+			FREE(poller);
+			return NULL;
+		}
+	}
 
 	struct socket_server *ss = MALLOC(sizeof(*ss));
-	ss->event_fd = efd;
-	ss->recvctrl_fd = fd[0];
-	ss->sendctrl_fd = fd[1];
-	ss->checkctrl = 1;
+	ss->poller_n = thread;
+	ss->poller = poller;
 
 	//初始化socket数组
 	for (i=0;i<MAX_SOCKET;i++) {
@@ -339,13 +484,14 @@ socket_server_create() {
 		s->type = SOCKET_TYPE_INVALID;
 		clear_wb_list(&s->high);
 		clear_wb_list(&s->low);
+		s->sending = 0;
+		s->pause_prev = s->pause_next = NULL;
+		spinlock_init(&s->dw_lock);
+		s->dw_buffer = NULL;
 	}
 	ss->alloc_id = 0;
-	ss->event_n = 0;
-	ss->event_index = 0;
+	ss->direct_write = 0;
 	memset(&ss->soi, 0, sizeof(ss->soi));
-	FD_ZERO(&ss->rfds); //初始化select描述符兴趣集合
-	assert(ss->recvctrl_fd < FD_SETSIZE);
 
 	return ss;
 }
@@ -363,6 +509,30 @@ free_wb_list(struct socket_server *ss, struct wb_list *list) {
 	list->tail = NULL;
 }
 
+//把socket加入(移出)poller的暂停读取链表
+static inline void
+pause_link(struct socket_poller *sp, struct socket *s) {
+	s->pause_prev = NULL;
+	s->pause_next = sp->paused;
+	if (sp->paused) {
+		sp->paused->pause_prev = s;
+	}
+	sp->paused = s;
+}
+
+static inline void
+pause_unlink(struct socket_poller *sp, struct socket *s) {
+	if (s->pause_prev) {
+		s->pause_prev->pause_next = s->pause_next;
+	} else {
+		sp->paused = s->pause_next;
+	}
+	if (s->pause_next) {
+		s->pause_next->pause_prev = s->pause_prev;
+	}
+	s->pause_prev = s->pause_next = NULL;
+}
+
 //强制关闭socket
 static void
 force_close(struct socket_server *ss, struct socket *s, struct socket_message *result) {
@@ -376,15 +546,29 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_message *r
 	assert(s->type != SOCKET_TYPE_RESERVE);
 	free_wb_list(ss,&s->high); //释放发送队列
 	free_wb_list(ss,&s->low);
+	struct socket_poller *sp = socket_poller(ss, s);
 	if (s->type != SOCKET_TYPE_PACCEPT && s->type != SOCKET_TYPE_PLISTEN) {
-		sp_del(ss->event_fd, s->fd); //将该socket句柄从epoll中移除，不再监听
+		sp_del(sp->event_fd, s->fd); //将该socket句柄从epoll中移除，不再监听
+	}
+	if (!s->reading) {
+		s->reading = true;
+		pause_unlink(sp, s);
 	}
+	// a worker may be writing to the fd directly
+	spinlock_lock(&s->dw_lock);
 	if (s->type != SOCKET_TYPE_BIND) { //关闭socket句柄
 		if (close(s->fd) < 0) {
 			perror("close socket:");
 		}
 	}
 	s->type = SOCKET_TYPE_INVALID; //将socket标记为无效
+	if (s->dw_buffer) {
+		struct send_object so;
+		send_object_init(ss, &so, (void *)s->dw_buffer, s->dw_size);
+		so.free_func((void *)s->dw_buffer);
+		s->dw_buffer = NULL;
+	}
+	spinlock_unlock(&s->dw_lock);
 }
 
 //销毁socket_server
@@ -398,9 +582,10 @@ socket_server_release(struct socket_server *ss) {
 			force_close(ss, s , &dummy);
 		}
 	}
-	close(ss->sendctrl_fd); //关闭管道写端
-	close(ss->recvctrl_fd);	//关闭管道读端
-	sp_release(ss->event_fd); //销毁poll
+	for (i=0;i<ss->poller_n;i++) {
+		poller_release(&ss->poller[i]);
+	}
+	FREE(ss->poller);
 	FREE(ss); //释放socket_server空间
 }
 
@@ -420,7 +605,7 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 	assert(s->type == SOCKET_TYPE_RESERVE);
 
 	if (add) {
-		if (sp_add(ss->event_fd, fd, s)) {
+		if (sp_add(socket_poller(ss, s)->event_fd, fd, s)) {
 			s->type = SOCKET_TYPE_INVALID;
 			return NULL;
 		}
@@ -433,11 +618,43 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 	s->opaque = opaque;
 	s->wb_size = 0;
 	s->warn_size = 0;
+	s->reading = true;
+	s->writing = false;
 	check_wb_list(&s->high);
 	check_wb_list(&s->low);
 	return s;
 }
 
+//统计发送的系统调用次数和包数，工作线程直接写时也会统计
+static inline void
+send_stat(struct socket_poller *sp, int syscall, int message) {
+	ATOM_ADD(&sp->send_syscall, syscall);
+	ATOM_ADD(&sp->send_message, message);
+}
+
+//修改socket在poll中监听的读写事件
+static inline void
+enable_write(struct socket_server *ss, struct socket *s, bool enable) {
+	struct socket_poller *sp = socket_poller(ss, s);
+	s->writing = enable;
+	sp_enable(sp->event_fd, s->fd, s, s->reading, enable);
+	send_stat(sp, 1, 0); //开关写事件也是发送的代价
+}
+
+static inline void
+enable_read(struct socket_server *ss, struct socket *s, bool enable) {
+	if (s->reading != enable) {
+		struct socket_poller *sp = socket_poller(ss, s);
+		s->reading = enable;
+		if (enable) {
+			pause_unlink(sp, s);
+		} else {
+			pause_link(sp, s);
+		}
+		sp_enable(sp->event_fd, s->fd, s, enable, s->writing);
+	}
+}
+
 //客户端连接，调用connect()
 // return -1 when connecting
 static int
@@ -497,14 +714,15 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 		ns->type = SOCKET_TYPE_CONNECTED;
 		struct sockaddr * addr = ai_ptr->ai_addr;
 		void * sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in *)addr)->sin_addr : (void*)&((struct sockaddr_in6 *)addr)->sin6_addr;
-		if (inet_ntop(ai_ptr->ai_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-			result->data = ss->buffer;
+		struct socket_poller *sp = socket_poller(ss, ns);
+		if (inet_ntop(ai_ptr->ai_family, sin_addr, sp->buffer, sizeof(sp->buffer))) {
+			result->data = sp->buffer;
 		}
 		freeaddrinfo( ai_list );
 		return SOCKET_OPEN;
 	} else {
 		ns->type = SOCKET_TYPE_CONNECTING;
-		sp_write(ss->event_fd, ns->fd, ns, true);
+		enable_write(ss, ns, true);
 	}
 
 	freeaddrinfo( ai_list );
@@ -515,13 +733,21 @@ _failed:
 	return SOCKET_ERR;
 }
 
-//发送tcp缓存队列
+//发送tcp缓存队列，连续的缓存块合并成一次writev
 static int
 send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+	struct socket_poller *sp = socket_poller(ss, s);
 	while (list->head) {
-		struct write_buffer * tmp = list->head;
+		struct write_buffer * tmp;
+		int n = 0;
+		for (tmp = list->head; tmp && n < MAX_IOV; tmp = tmp->next) {
+			sp->iov[n].iov_base = tmp->ptr;
+			sp->iov[n].iov_len = tmp->sz;
+			++n;
+		}
+		ssize_t sz;
 		for (;;) {
-			int sz = write(s->fd, tmp->ptr, tmp->sz);
+			sz = writev(s->fd, sp->iov, n);
 			//发送错误了
 			if (sz < 0) {
 				switch(errno) {
@@ -533,16 +759,23 @@ send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 				force_close(ss,s, result);
 				return SOCKET_CLOSE;
 			}
-			s->wb_size -= sz;
-			if (sz != tmp->sz) { //没发送给完
-				tmp->ptr += sz; //ptr指向位发送给数据首部地址
+			break;
+		}
+		s->wb_size -= sz;
+		int i;
+		for (i=0;i<n;i++) {
+			tmp = list->head;
+			if (sz < tmp->sz) { //没发送完
+				tmp->ptr += sz; //ptr指向未发送数据首部地址
 				tmp->sz -= sz;  //重新计算未发送块的数据大小
+				send_stat(sp, 1, i);
 				return -1;
 			}
-			break;
+			sz -= tmp->sz;
+			list->head = tmp->next; //指向下一个缓存区块
+			write_buffer_free(ss,tmp); //释放已发送的区块内存
 		}
-		list->head = tmp->next; //指向下一个缓存区块
-		write_buffer_free(ss,tmp); //释放已发送的区块内存
+		send_stat(sp, 1, n);
 	}
 	list->tail = NULL;
 
@@ -573,6 +806,54 @@ udp_socket_address(struct socket *s, const uint8_t udp_address[UDP_ADDRESS_SIZE]
 	return 0;
 }
 
+#ifdef UDP_MMSG
+
+//发送udp缓存队列，一次sendmmsg发送多个包
+static int
+send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+	struct socket_poller *sp = socket_poller(ss, s);
+	while (list->head) {
+		struct write_buffer * tmp;
+		int n = 0;
+		for (tmp = list->head; tmp && n < MAX_UDP_BATCH; tmp = tmp->next) {
+			struct msghdr *h = &sp->msg[n].msg_hdr;
+			memset(h, 0, sizeof(*h));
+			h->msg_name = &sp->addr[n];
+			h->msg_namelen = udp_socket_address(s, tmp->udp_address, &sp->addr[n]);
+			sp->iov[n].iov_base = tmp->ptr;
+			sp->iov[n].iov_len = tmp->sz;
+			h->msg_iov = &sp->iov[n];
+			h->msg_iovlen = 1;
+			++n;
+		}
+		int err = sendmmsg(s->fd, sp->msg, n, 0);
+		if (err <= 0) {
+			if (err == 0)
+				return -1;
+			switch(errno) {
+			case EINTR:
+			case AGAIN_WOULDBLOCK:
+				return -1;
+			}
+			fprintf(stderr, "socket-server : udp (%d) sendmmsg error %s.\n",s->id, strerror(errno));
+			return -1;
+		}
+		send_stat(sp, 1, err);
+		int i;
+		for (i=0;i<err;i++) {
+			tmp = list->head;
+			s->wb_size -= tmp->sz;
+			list->head = tmp->next;
+			write_buffer_free(ss,tmp);
+		}
+	}
+	list->tail = NULL;
+
+	return -1;
+}
+
+#else
+
 static int
 send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
 	while (list->head) {
@@ -599,6 +880,7 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 */
 		}
 
+		send_stat(socket_poller(ss, s), 1, 1);
 		s->wb_size -= tmp->sz;
 		list->head = tmp->next;
 		write_buffer_free(ss,tmp);
@@ -608,6 +890,8 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 	return -1;
 }
 
+#endif
+
 //发送缓存队列
 static int
 send_list(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
@@ -688,7 +972,7 @@ send_buffer(struct socket_server *ss, struct socket *s, struct socket_message *r
 		// step 4
 		// socket发送队列全部为空，将epoll中该socket的写监听取消
 		assert(send_buffer_empty(s) && s->wb_size == 0);
-		sp_write(ss->event_fd, s->fd, s, false);			
+		enable_write(ss, s, false);
 
 		//如果之前标记了要关闭套接字，但由于套接字数据没有发送完，只是标记要关闭，则
 		// 此时数据发送完了  直接强制关闭,销毁套接字
@@ -751,12 +1035,33 @@ append_sendbuffer_low(struct socket_server *ss,struct socket *s, struct request_
 }
 
 
+//把工作线程直接写剩下的部分移到高优先级发送队列，等待可写时发送
+//直接写时发送队列是空的，之后的发送命令都会先调用这里，所以它总在队列的最前面
+//持有锁也保证了之后socket线程自己写fd时，没有工作线程正在写
+static void
+take_direct_write(struct socket_server *ss, struct socket *s) {
+	spinlock_lock(&s->dw_lock);
+	if (s->dw_buffer) {
+		struct request_send request;
+		request.id = s->id;
+		request.sz = s->dw_size;
+		request.buffer = (char *)s->dw_buffer;
+		append_sendbuffer(ss, s, &request, s->dw_offset);
+		s->dw_buffer = NULL;
+		enable_write(ss, s, true);
+	}
+	spinlock_unlock(&s->dw_lock);
+}
+
 /*
 	When send a package , we can assign the priority : PRIORITY_HIGH or PRIORITY_LOW
 
 	If socket buffer is empty, write to fd directly.
 		If write a part, append the rest part to high list. (Even priority is PRIORITY_LOW)
 	Else append package to high (PRIORITY_HIGH) or low (PRIORITY_LOW) list.
+
+	If more sends for the same socket are waiting in the ring, append the package even if the buffer
+	is empty, the packages of a burst are sent by one writev (or sendmmsg) when the socket is writable.
  */
 static int
 send_socket(struct socket_server *ss, struct request_send * request, struct socket_message *result, int priority, const uint8_t *udp_address) {
@@ -775,9 +1080,15 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 		so.free_func(request->buffer);
 		return -1;
 	}
-	if (send_buffer_empty(s) && s->type == SOCKET_TYPE_CONNECTED) {
+	// the rest of a direct write goes before this one
+	take_direct_write(ss, s);
+	struct socket_poller *sp = socket_poller(ss, s);
+	bool idle = send_buffer_empty(s) && s->type == SOCKET_TYPE_CONNECTED;
+	// s->sending counts this command too, it is decreased after send_socket returns
+	if (idle && s->sending <= 1) {
 		if (s->protocol == PROTOCOL_TCP) {
 			int n = write(s->fd, so.buffer, so.sz);
+			send_stat(sp, 1, n == so.sz);
 			if (n<0) {
 				switch(errno) {
 				case EINTR:
@@ -804,6 +1115,7 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 			union sockaddr_all sa;
 			socklen_t sasz = udp_socket_address(s, udp_address, &sa);
 			int n = sendto(s->fd, so.buffer, so.sz, 0, &sa.s, sasz);
+			send_stat(sp, 1, n == so.sz);
 			if (n != so.sz) {
 				append_sendbuffer_udp(ss,s,priority,request,udp_address);
 			} else {
@@ -811,7 +1123,7 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 				return -1;
 			}
 		}
-		sp_write(ss->event_fd, s->fd, s, true);
+		enable_write(ss, s, true);
 	} else {
 		if (s->protocol == PROTOCOL_TCP) {
 			if (priority == PRIORITY_LOW) {
@@ -825,6 +1137,9 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 			}
 			append_sendbuffer_udp(ss,s,priority,request,udp_address);
 		}
+		if (idle) {
+			enable_write(ss, s, true);
+		}
 	}
 	if (s->wb_size >= WARNING_SIZE && s->wb_size >= s->warn_size) {
 		s->warn_size = s->warn_size == 0 ? WARNING_SIZE *2 : s->warn_size*2;
@@ -925,7 +1240,7 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 		return SOCKET_ERR;
 	}
 	if (s->type == SOCKET_TYPE_PACCEPT || s->type == SOCKET_TYPE_PLISTEN) {
-		if (sp_add(ss->event_fd, s->fd, s)) {
+		if (sp_add(socket_poller(ss, s)->event_fd, s->fd, s)) {
 			force_close(ss, s, result);
 			result->data = strerror(errno);
 			return SOCKET_ERR;
@@ -937,6 +1252,8 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 	} else if (s->type == SOCKET_TYPE_CONNECTED) {
 		// todo: maybe we should send a message SOCKET_TRANSFER to s->opaque
 		s->opaque = request->opaque;
+		// the new owner doesn't know it was paused for the old one
+		enable_read(ss, s, true);
 		result->data = "transfer";
 		return SOCKET_OPEN;
 	}
@@ -955,45 +1272,66 @@ setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 	setsockopt(s->fd, IPPROTO_TCP, request->what, &v, sizeof(v));
 }
 
-//阻塞的读管道
-//pipefd 管道的读端描述符
-//buffer 读的内容存储到buffer中
-//sz 每次读的大小
+//恢复读取所有因服务opaque饱和而暂停的socket，只遍历这个poller暂停的socket
 static void
-block_readpipe(int pipefd, void *buffer, int sz) {
-	for (;;) {
-		int n = read(pipefd, buffer, sz);
-		if (n<0) {
-			if (errno == EINTR)
-				continue;
-			fprintf(stderr, "socket-server : read pipe error %s.\n",strerror(errno));
-			return;
+resume_socket(struct socket_server *ss, struct socket_poller *sp, struct request_resume *request) {
+	struct socket *s = sp->paused;
+	while (s) {
+		struct socket *next = s->pause_next;
+		if (s->opaque == request->opaque) {
+			enable_read(ss, s, true);
 		}
-		// must atomic read from a pipe
-		assert(n == sz);
-		return;
+		s = next;
 	}
 }
 
-//判断管道中是否有可读的命令
-//返回 1 表示有
-//否则 0 表示没有
-static int
-has_cmd(struct socket_server *ss) {
-	struct timeval tv = {0,0};
-	int retval;
-
-	FD_SET(ss->recvctrl_fd, &ss->rfds); //将管道读端，添加到rfds集合中
+//唤醒socket线程，之前已经有人唤醒(还没被处理)时不用再写
+static void
+ctrl_signal(struct socket_poller *sp) {
+	if (!ATOM_CAS(&sp->notify, 0, 1))
+		return;
+	for (;;) {
+#ifdef CTRL_EVENTFD
+		uint64_t one = 1;
+		int n = write(sp->sendctrl_fd, &one, sizeof(one));
+#else
+		char one = 0;
+		int n = write(sp->sendctrl_fd, &one, sizeof(one));
+#endif
+		if (n < 0 && errno == EINTR)
+			continue;
+		return;
+	}
+}
 
-	//select关心读，所起写和异常的设置位NULL
-	//第一个参数设置位比最的的感兴趣的文件描述符大1,这样select更有效率，因为内核不用检查比该文件描述符还大的是否属于兴趣集合
-	//最后一个参数位timeout，如果为NULL则select会一直阻塞，如果指向一个timeval结构体，且两个域都是0的话，select不会阻塞，
-	//只是简单轮询指定的文件描述符集合，看是否有就绪文件描述符并立即返回。或者指定select等带的时间上限。
-	retval = select(ss->recvctrl_fd+1, &ss->rfds, NULL, NULL, &tv);
-	if (retval == 1) { //因为只关心一个管道读端，所以如果就绪只可能返回1 （就绪的个数）
-		return 1;
+//socket线程被唤醒后清除eventfd，之后的命令需要重新唤醒
+static void
+ctrl_clear(struct socket_poller *sp) {
+	char tmp[64];
+	while (read(sp->recvctrl_fd, tmp, sizeof(tmp)) > 0) {
+#ifdef CTRL_EVENTFD
+		break;
+#endif
 	}
-	return 0;
+	sp->notify = 0;
+	// pairs with the ATOM_CAS in ctrl_signal, a command published before it
+	// either sees notify == 0 and signals again, or is seen by the next pop
+	__sync_synchronize();
+}
+
+//取出命令环中下一个命令，复制到buffer中，返回命令类型，没有命令时返回0
+static int
+ctrl_pop(struct socket_poller *sp, uint8_t buffer[256]) {
+	struct ctrl_slot *slot = &sp->ring[sp->head & (CTRL_RING_SIZE-1)];
+	if (slot->seq != sp->head + 1)
+		return 0;
+	__sync_synchronize();
+	int type = slot->type;
+	memcpy(buffer, slot->buffer, slot->len);
+	__sync_synchronize();
+	slot->seq = sp->head + CTRL_RING_SIZE;
+	++sp->head;
+	return type;
 }
 
 //添加udpsocket
@@ -1042,18 +1380,10 @@ set_udp_address(struct socket_server *ss, struct request_setudp *request, struct
 }
 
 // return type
-// 读管道中的命令
+// 处理命令环中取出的命令
 static int
-ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
-	int fd = ss->recvctrl_fd;
-	// the length of message is one byte, so 256+8 buffer size is enough.
-	uint8_t buffer[256];
-	uint8_t header[2]; //一个类型，一个长度
-	block_readpipe(fd, header, sizeof(header)); //先读两个字节，一个类型一个长度
-	int type = header[0];
-	int len = header[1];
-	block_readpipe(fd, buffer, len); //然后读命令，存储到buffer中
-	// ctrl command only exist in local fd, so don't worry about endian.
+ctrl_cmd(struct socket_server *ss, struct socket_poller *sp, int type, uint8_t *buffer, struct socket_message *result) {
+	// ctrl command only exist in local memory, so don't worry about endian.
 	switch (type) {
 	case 'S':
 		return start_socket(ss,(struct request_start *)buffer, result);
@@ -1072,12 +1402,23 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		result->data = NULL;
 		return SOCKET_EXIT;
 	case 'D':
-		return send_socket(ss, (struct request_send *)buffer, result, PRIORITY_HIGH, NULL);
-	case 'P':
-		return send_socket(ss, (struct request_send *)buffer, result, PRIORITY_LOW, NULL);
+	case 'P': {
+		struct request_send * request = (struct request_send *)buffer;
+		int ret = send_socket(ss, request, result, type == 'D' ? PRIORITY_HIGH : PRIORITY_LOW, NULL);
+		// the data is written or queued, the workers may write directly again
+		ATOM_DEC(&ss->slot[HASH_ID(request->id)].sending);
+		return ret;
+	}
+	case 'W': {
+		struct socket *s = &ss->slot[HASH_ID(((struct request_send *)buffer)->id)];
+		take_direct_write(ss, s);
+		return -1;
+	}
 	case 'A': {
 		struct request_send_udp * rsu = (struct request_send_udp *)buffer;
-		return send_socket(ss, &rsu->send, result, PRIORITY_HIGH, rsu->address);
+		int ret = send_socket(ss, &rsu->send, result, PRIORITY_HIGH, rsu->address);
+		ATOM_DEC(&ss->slot[HASH_ID(rsu->send.id)].sending);
+		return ret;
 	}
 	case 'C':
 		return set_udp_address(ss, (struct request_setudp *)buffer, result);
@@ -1087,6 +1428,9 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	case 'U':
 		add_udp_socket(ss, (struct request_udp *)buffer);
 		return -1;
+	case 'R':
+		resume_socket(ss, sp, (struct request_resume *)buffer);
+		return -1;
 	default:
 		fprintf(stderr, "socket-server: Unknown ctrl %c.\n",type);
 		return -1;
@@ -1162,11 +1506,59 @@ gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t * udp_address) {
 	return addrsz;
 }
 
+//读到的一个udp包，复制出来，后面跟着发送方的地址
+static int
+udp_package(struct socket *s, const uint8_t *buffer, int n, union sockaddr_all *sa, socklen_t slen, struct socket_message * result) {
+	uint8_t * data;
+	if (slen == sizeof(sa->v4)) {
+		if (s->protocol != PROTOCOL_UDP)
+			return -1;
+		data = MALLOC(n + 1 + 2 + 4);
+		gen_udp_address(PROTOCOL_UDP, sa, data + n);
+	} else {
+		if (s->protocol != PROTOCOL_UDPv6)
+			return -1;
+		data = MALLOC(n + 1 + 2 + 16);
+		gen_udp_address(PROTOCOL_UDPv6, sa, data + n);
+	}
+	memcpy(data, buffer, n);
+
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = n;
+	result->data = (char *)data;
+
+	return SOCKET_UDP;
+}
+
+#ifdef UDP_MMSG
+
+static inline int
+udp_protocol(socklen_t slen) {
+	return slen == sizeof(struct sockaddr_in) ? PROTOCOL_UDP : PROTOCOL_UDPv6;
+}
+
+/*
+	Read up to MAX_UDP_RECV packages by one recvmmsg. A single package is reported as SOCKET_UDP,
+	more are packed into one SOCKET_UDPBATCH message, so a flood costs one syscall, one malloc
+	and one message per batch. Each package in the batch is :
+		uint16_t size , uint8_t address size , data[size] , address
+ */
 static int
 forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_message * result) {
-	union sockaddr_all sa;
-	socklen_t slen = sizeof(sa);
-	int n = recvfrom(s->fd, ss->udpbuffer,MAX_UDP_PACKAGE,0,&sa.s,&slen);
+	struct socket_poller *sp = socket_poller(ss, s);
+	int i;
+	for (i=0;i<MAX_UDP_RECV;i++) {
+		struct msghdr *h = &sp->msg[i].msg_hdr;
+		memset(h, 0, sizeof(*h));
+		h->msg_name = &sp->addr[i];
+		h->msg_namelen = sizeof(sp->addr[i]);
+		sp->iov[i].iov_base = sp->udpbuffer + i * MAX_UDP_PACKAGE;
+		sp->iov[i].iov_len = MAX_UDP_PACKAGE;
+		h->msg_iov = &sp->iov[i];
+		h->msg_iovlen = 1;
+	}
+	int n = recvmmsg(s->fd, sp->msg, MAX_UDP_RECV, 0, NULL);
 	if (n<0) {
 		switch(errno) {
 		case EINTR:
@@ -1180,28 +1572,64 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_me
 		}
 		return -1;
 	}
-	uint8_t * data;
-	if (slen == sizeof(sa.v4)) {
-		if (s->protocol != PROTOCOL_UDP)
-			return -1;
-		data = MALLOC(n + 1 + 2 + 4);
-		gen_udp_address(PROTOCOL_UDP, &sa, data + n);
-	} else {
-		if (s->protocol != PROTOCOL_UDPv6)
-			return -1;
-		data = MALLOC(n + 1 + 2 + 16);
-		gen_udp_address(PROTOCOL_UDPv6, &sa, data + n);
+	if (n == 1) {
+		return udp_package(s, sp->udpbuffer, sp->msg[0].msg_len, &sp->addr[0], sp->msg[0].msg_hdr.msg_namelen, result);
+	}
+	int sz = 0;
+	for (i=0;i<n;i++) {
+		socklen_t slen = sp->msg[i].msg_hdr.msg_namelen;
+		if (udp_protocol(slen) == s->protocol) {
+			sz += 2 + 1 + sp->msg[i].msg_len + (s->protocol == PROTOCOL_UDP ? 1 + 2 + 4 : 1 + 2 + 16);
+		}
+	}
+	if (sz == 0)
+		return -1;
+	uint8_t * data = MALLOC(sz);
+	uint8_t * p = data;
+	for (i=0;i<n;i++) {
+		if (udp_protocol(sp->msg[i].msg_hdr.msg_namelen) != s->protocol)
+			continue;
+		uint16_t len = sp->msg[i].msg_len;
+		memcpy(p, &len, sizeof(len));
+		memcpy(p + 3, sp->iov[i].iov_base, len);
+		p[2] = gen_udp_address(s->protocol, &sp->addr[i], p + 3 + len);
+		p += 3 + len + p[2];
 	}
-	memcpy(data, ss->udpbuffer, n);
 
 	result->opaque = s->opaque;
 	result->id = s->id;
-	result->ud = n;
+	result->ud = sz;
 	result->data = (char *)data;
 
-	return SOCKET_UDP;
+	return SOCKET_UDPBATCH;
 }
 
+#else
+
+static int
+forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_message * result) {
+	struct socket_poller *sp = socket_poller(ss, s);
+	union sockaddr_all sa;
+	socklen_t slen = sizeof(sa);
+	int n = recvfrom(s->fd, sp->udpbuffer,MAX_UDP_PACKAGE,0,&sa.s,&slen);
+	if (n<0) {
+		switch(errno) {
+		case EINTR:
+		case AGAIN_WOULDBLOCK:
+			break;
+		default:
+			// close when error
+			force_close(ss, s, result);
+			result->data = strerror(errno);
+			return SOCKET_ERR;
+		}
+		return -1;
+	}
+	return udp_package(s, sp->udpbuffer, n, &sa, slen, result);
+}
+
+#endif
+
 //socket 连接
 static int
 report_connect(struct socket_server *ss, struct socket *s, struct socket_message *result) {
@@ -1221,14 +1649,15 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_message
 		result->id = s->id;
 		result->ud = 0;
 		if (send_buffer_empty(s)) {
-			sp_write(ss->event_fd, s->fd, s, false);
+			enable_write(ss, s, false);
 		}
 		union sockaddr_all u;
 		socklen_t slen = sizeof(u);
 		if (getpeername(s->fd, &u.s, &slen) == 0) {
 			void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-			if (inet_ntop(u.s.sa_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-				result->data = ss->buffer;
+			struct socket_poller *sp = socket_poller(ss, s);
+			if (inet_ntop(u.s.sa_family, sin_addr, sp->buffer, sizeof(sp->buffer))) {
+				result->data = sp->buffer;
 				return SOCKET_OPEN;
 			}
 		}
@@ -1256,6 +1685,7 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 			return 0;
 		}
 	}
+	// the new socket may belong to another poller, it's added to that epoll by socket_server_start
 	int id = reserve_id(ss);
 	if (id < 0) {
 		close(client_fd);
@@ -1278,8 +1708,9 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 	int sin_port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
 	char tmp[INET6_ADDRSTRLEN];
 	if (inet_ntop(u.s.sa_family, sin_addr, tmp, sizeof(tmp))) {
-		snprintf(ss->buffer, sizeof(ss->buffer), "%s:%d", tmp, sin_port);
-		result->data = ss->buffer;
+		struct socket_poller *sp = socket_poller(ss, s);
+		snprintf(sp->buffer, sizeof(sp->buffer), "%s:%d", tmp, sin_port);
+		result->data = sp->buffer;
 	}
 
 	return 1;
@@ -1287,12 +1718,12 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 
 //清理关闭或错误的socket
 static inline void 
-clear_closed_event(struct socket_server *ss, struct socket_message * result, int type) {
+clear_closed_event(struct socket_poller *sp, struct socket_message * result, int type) {
 	if (type == SOCKET_CLOSE || type == SOCKET_ERR) {
 		int id = result->id;
 		int i;
-		for (i=ss->event_index; i<ss->event_n; i++) {
-			struct event *e = &ss->ev[i];
+		for (i=sp->event_index; i<sp->event_n; i++) {
+			struct event *e = &sp->ev[i];
 			struct socket *s = e->s;
 			if (s) {
 				if (s->type == SOCKET_TYPE_INVALID && s->id == id) {
@@ -1305,35 +1736,40 @@ clear_closed_event(struct socket_server *ss, struct socket_message * result, int
 }
 
 // return type
+// thread: 第几个socket线程，只处理这个线程的poller
 int 
-socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
+socket_server_poll(struct socket_server *ss, int thread, struct socket_message * result, int * more) {
+	struct socket_poller *sp = &ss->poller[thread];
 	for (;;) {
-		//检查管道
-		if (ss->checkctrl) {
-			if (has_cmd(ss)) { //检查管道读端是否就绪
-				int type = ctrl_cmd(ss, result);
+		//检查命令环
+		if (sp->checkctrl) {
+			// the length of message is one byte, so 256 buffer size is enough.
+			uint8_t buffer[256];
+			int cmd = ctrl_pop(sp, buffer);
+			if (cmd) {
+				int type = ctrl_cmd(ss, sp, cmd, buffer, result);
 				if (type != -1) {
-					clear_closed_event(ss, result, type);
+					clear_closed_event(sp, result, type);
 					return type;
 				} else
 					continue;
 			} else {
-				ss->checkctrl = 0; //标记不检查
+				sp->checkctrl = 0; //标记不检查
 			}
 		}
 
 		//没有就绪事件
-		if (ss->event_index == ss->event_n) {
+		if (sp->event_index == sp->event_n) {
 			//int n = epoll_wait(efd , ev, max, -1);
 			//epoll_wait的timeout是-1，所以会阻塞，一直等到有就绪的或者信号终端才返回
-			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
-			ss->checkctrl = 1; //检查管道
+			sp->event_n = sp_wait(sp->event_fd, sp->ev, MAX_EVENT);
+			sp->checkctrl = 1; //检查管道
 			if (more) {
 				*more = 0; //标记已经wait过了
 			}
-			ss->event_index = 0;
-			if (ss->event_n <= 0) {
-				ss->event_n = 0;
+			sp->event_index = 0;
+			if (sp->event_n <= 0) {
+				sp->event_n = 0;
 				//被信号中断了，重新wait
 				if (errno == EINTR) {
 					continue;
@@ -1343,16 +1779,22 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 		}
 
 		//获取就绪列表中的事件
-		struct event *e = &ss->ev[ss->event_index++];
+		struct event *e = &sp->ev[sp->event_index++];
 		struct socket *s = e->s;
 		if (s == NULL) {
-			// dispatch pipe message at beginning
+			// woken up by a command, check the ring again
+			ctrl_clear(sp);
+			sp->checkctrl = 1;
 			continue;
 		}
 		switch (s->type) {
 		case SOCKET_TYPE_CONNECTING: //对外连接，写
 			return report_connect(ss, s, result);
 		case SOCKET_TYPE_LISTEN: { //监听，读, 接受到客户端连接
+			if (!s->reading) {
+				// paused in this round of events
+				break;
+			}
 			int ok = report_accept(ss, s, result);
 			if (ok > 0) {
 				return SOCKET_ACCEPT;
@@ -1366,23 +1808,23 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 			fprintf(stderr, "socket-server: invalid socket\n");
 			break;
 		default:
-			//事件是读事件
-			if (e->read) {
+			//事件是读事件，暂停读取时忽略
+			if (e->read && s->reading) {
 				int type;
 				if (s->protocol == PROTOCOL_TCP) {
 					type = forward_message_tcp(ss, s, result);
 				} else {
 					type = forward_message_udp(ss, s, result);
-					if (type == SOCKET_UDP) {
+					if (type == SOCKET_UDP || type == SOCKET_UDPBATCH) {
 						// try read again
-						--ss->event_index;
-						return SOCKET_UDP;
+						--sp->event_index;
+						return type;
 					}
 				}
 				if (e->write && type != SOCKET_CLOSE && type != SOCKET_ERR) {
 					// Try to dispatch write message next step if write flag set.
 					e->read = false;
-					--ss->event_index;
+					--sp->event_index;
 				}
 				if (type == -1)
 					break;				
@@ -1400,23 +1842,23 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 	}
 }
 
-//向管道中写数据
+//把命令写入poller的命令环，操作某个socket的命令要发给它所属的poller
 static void
-send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
-	request->header[6] = (uint8_t)type;
-	request->header[7] = (uint8_t)len;
-	for (;;) {
-		//向发送管道写数据，write的返回值为写的字节数
-		int n = write(ss->sendctrl_fd, &request->header[6], len+2); //类型+长度+结构体
-		if (n<0) {
-			if (errno != EINTR) {
-				fprintf(stderr, "socket-server : send ctrl command error %s.\n", strerror(errno));
-			}
-			continue;
-		}
-		assert(n == len+2);
-		return;
-	}
+send_request(struct socket_poller *sp, struct request_package *request, char type, int len) {
+	assert(len < 256);
+	uint32_t pos = ATOM_FINC(&sp->tail);
+	struct ctrl_slot *slot = &sp->ring[pos & (CTRL_RING_SIZE-1)];
+	while (slot->seq != pos) {
+		// the ring is full, wait for the socket thread
+		sched_yield();
+	}
+	__sync_synchronize();
+	slot->type = (uint8_t)type;
+	slot->len = (uint8_t)len;
+	memcpy(slot->buffer, &request->u, len);
+	__sync_synchronize();
+	slot->seq = pos + 1;
+	ctrl_signal(sp);
 }
 
 //打开请求，组织一个请求包
@@ -1450,7 +1892,7 @@ socket_server_connect(struct socket_server *ss, uintptr_t opaque, const char * a
 	if (len < 0)
 		return -1;
 	//向管道写入O事件，
-	send_request(ss, &request, 'O', sizeof(request.u.open) + len);
+	send_request(id_poller(ss, request.u.open.id), &request, 'O', sizeof(request.u.open) + len);
 	return request.u.open.id;
 }
 
@@ -1461,47 +1903,90 @@ free_buffer(struct socket_server *ss, const void * buffer, int sz) {
 	so.free_func((void *)buffer);
 }
 
-// return -1 when error, 0 when success
-int 
-socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
-	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
-		free_buffer(ss, buffer, sz);
+//没有排队的数据时，工作线程可以直接写
+static inline int
+can_direct_write(struct socket *s, int id) {
+	return s->id == id && s->type == SOCKET_TYPE_CONNECTED && s->protocol == PROTOCOL_TCP
+		&& s->sending == 0 && s->dw_buffer == NULL && send_buffer_empty(s);
+}
+
+//在工作线程中直接写，返回0表示已经写完或者剩下的交给了socket线程，-1表示需要走命令环
+static int
+direct_write(struct socket_server *ss, struct socket *s, int id, const void * buffer, int sz) {
+	if (!can_direct_write(s, id) || !spinlock_trylock(&s->dw_lock))
 		return -1;
+	// check again with the lock, the socket thread may take the socket meanwhile
+	if (!can_direct_write(s, id)) {
+		spinlock_unlock(&s->dw_lock);
+		return -1;
+	}
+	struct send_object so;
+	send_object_init(ss, &so, (void *)buffer, sz);
+	int n = write(s->fd, so.buffer, so.sz);
+	send_stat(socket_poller(ss, s), 1, n == so.sz);
+	if (n < 0) {
+		// leave the error (or EAGAIN) to the socket thread
+		n = 0;
+	}
+	if (n == so.sz) {
+		spinlock_unlock(&s->dw_lock);
+		so.free_func((void *)buffer);
+		return 0;
 	}
+	s->dw_buffer = buffer;
+	s->dw_size = sz;
+	s->dw_offset = n;
+	spinlock_unlock(&s->dw_lock);
 
 	struct request_package request;
 	request.u.send.id = id;
-	request.u.send.sz = sz;
-	request.u.send.buffer = (char *)buffer;
-
-	send_request(ss, &request, 'D', sizeof(request.u.send));
+	request.u.send.sz = 0;
+	request.u.send.buffer = NULL;
+	send_request(id_poller(ss, id), &request, 'W', sizeof(request.u.send));
 	return 0;
 }
 
-// return -1 when error, 0 when success
-int 
-socket_server_send_lowpriority(struct socket_server *ss, int id, const void * buffer, int sz) {
+static int
+send_tcp(struct socket_server *ss, int id, const void * buffer, int sz, char type) {
 	struct socket * s = &ss->slot[HASH_ID(id)];
 	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
 		free_buffer(ss, buffer, sz);
 		return -1;
 	}
+	if (type == 'D' && ss->direct_write && direct_write(ss, s, id, buffer, sz) == 0) {
+		return 0;
+	}
 
 	struct request_package request;
 	request.u.send.id = id;
 	request.u.send.sz = sz;
 	request.u.send.buffer = (char *)buffer;
 
-	send_request(ss, &request, 'P', sizeof(request.u.send));
+	ATOM_INC(&s->sending);
+	send_request(id_poller(ss, id), &request, type, sizeof(request.u.send));
 	return 0;
 }
 
+// return -1 when error, 0 when success
+int 
+socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz) {
+	return send_tcp(ss, id, buffer, sz, 'D');
+}
+
+// return -1 when error, 0 when success
+int 
+socket_server_send_lowpriority(struct socket_server *ss, int id, const void * buffer, int sz) {
+	return send_tcp(ss, id, buffer, sz, 'P');
+}
+
 //退出socket线程
 void
 socket_server_exit(struct socket_server *ss) {
 	struct request_package request;
-	send_request(ss, &request, 'X', 0);
+	int i;
+	for (i=0;i<ss->poller_n;i++) {
+		send_request(&ss->poller[i], &request, 'X', 0);
+	}
 }
 
 void
@@ -1510,7 +1995,7 @@ socket_server_close(struct socket_server *ss, uintptr_t opaque, int id) {
 	request.u.close.id = id;
 	request.u.close.shutdown = 0;
 	request.u.close.opaque = opaque;
-	send_request(ss, &request, 'K', sizeof(request.u.close));
+	send_request(id_poller(ss, id), &request, 'K', sizeof(request.u.close));
 }
 
 
@@ -1520,7 +2005,7 @@ socket_server_shutdown(struct socket_server *ss, uintptr_t opaque, int id) {
 	request.u.close.id = id;
 	request.u.close.shutdown = 1;
 	request.u.close.opaque = opaque;
-	send_request(ss, &request, 'K', sizeof(request.u.close));
+	send_request(id_poller(ss, id), &request, 'K', sizeof(request.u.close));
 }
 
 // return -1 means failed
@@ -1607,7 +2092,7 @@ socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * ad
 	request.u.listen.opaque = opaque; //服务地址
 	request.u.listen.id = id;
 	request.u.listen.fd = fd;
-	send_request(ss, &request, 'L', sizeof(request.u.listen)); //进管道
+	send_request(id_poller(ss, id), &request, 'L', sizeof(request.u.listen)); //进管道
 	return id;
 }
 
@@ -1621,7 +2106,7 @@ socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
 	request.u.bind.opaque = opaque;
 	request.u.bind.id = id;
 	request.u.bind.fd = fd;
-	send_request(ss, &request, 'B', sizeof(request.u.bind));
+	send_request(id_poller(ss, id), &request, 'B', sizeof(request.u.bind));
 	return id;
 }
 
@@ -1633,7 +2118,7 @@ socket_server_start(struct socket_server *ss, uintptr_t opaque, int id) {
 	struct request_package request;
 	request.u.start.id = id;
 	request.u.start.opaque = opaque;
-	send_request(ss, &request, 'S', sizeof(request.u.start));
+	send_request(id_poller(ss, id), &request, 'S', sizeof(request.u.start));
 }
 
 void
@@ -1642,7 +2127,30 @@ socket_server_nodelay(struct socket_server *ss, int id) {
 	request.u.setopt.id = id;
 	request.u.setopt.what = TCP_NODELAY;
 	request.u.setopt.value = 1;
-	send_request(ss, &request, 'T', sizeof(request.u.setopt));
+	send_request(id_poller(ss, id), &request, 'T', sizeof(request.u.setopt));
+}
+
+//暂停读取socket，只能在socket线程中调用（socket_server_poll返回的消息处理时）
+void
+socket_server_pause(struct socket_server *ss, int id) {
+	struct socket *s = &ss->slot[HASH_ID(id)];
+	if (s->id != id) {
+		return;
+	}
+	if (s->type == SOCKET_TYPE_CONNECTED || s->type == SOCKET_TYPE_LISTEN) {
+		enable_read(ss, s, false);
+	}
+}
+
+//恢复读取所有属于opaque的暂停的socket
+void
+socket_server_resume(struct socket_server *ss, uintptr_t opaque) {
+	struct request_package request;
+	request.u.resume.opaque = opaque;
+	int i;
+	for (i=0;i<ss->poller_n;i++) {
+		send_request(&ss->poller[i], &request, 'R', sizeof(request.u.resume));
+	}
 }
 
 void 
@@ -1650,6 +2158,24 @@ socket_server_userobject(struct socket_server *ss, struct socket_object_interfac
 	ss->soi = *soi;
 }
 
+void
+socket_server_directwrite(struct socket_server *ss, int enable) {
+	ss->direct_write = enable;
+}
+
+//所有socket线程发送数据的系统调用次数和发送完的包数
+void
+socket_server_sendstat(struct socket_server *ss, uint64_t *syscall, uint64_t *message) {
+	uint64_t c = 0, m = 0;
+	int i;
+	for (i=0;i<ss->poller_n;i++) {
+		c += ss->poller[i].send_syscall;
+		m += ss->poller[i].send_message;
+	}
+	*syscall = c;
+	*message = m;
+}
+
 // UDP
 
 int 
@@ -1682,7 +2208,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 	request.u.udp.opaque = opaque;
 	request.u.udp.family = family;
 
-	send_request(ss, &request, 'U', sizeof(request.u.udp));	
+	send_request(id_poller(ss, id), &request, 'U', sizeof(request.u.udp));	
 	return id;
 }
 
@@ -1715,7 +2241,8 @@ socket_server_udp_send(struct socket_server *ss, int id, const struct socket_udp
 
 	memcpy(request.u.send_udp.address, udp_address, addrsz);	
 
-	send_request(ss, &request, 'A', sizeof(request.u.send_udp.send)+addrsz);
+	ATOM_INC(&s->sending);
+	send_request(id_poller(ss, id), &request, 'A', sizeof(request.u.send_udp.send)+addrsz);
 	return 0;
 }
 
@@ -1753,7 +2280,7 @@ socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, i
 
 	freeaddrinfo( ai_list );
 
-	send_request(ss, &request, 'C', sizeof(request.u.set_udp) - sizeof(request.u.set_udp.address) +addrsz);
+	send_request(id_poller(ss, id), &request, 'C', sizeof(request.u.set_udp) - sizeof(request.u.set_udp.address) +addrsz);
 
 	return 0;
 }
@@ -11,6 +11,7 @@
 #define SOCKET_EXIT 5
 #define SOCKET_UDP 6
 #define SOCKET_WARNING 7
+#define SOCKET_UDPBATCH 8
 
 struct socket_server;
 
@@ -23,15 +24,21 @@ struct socket_message {
 	char * data; //数据
 };
 
-struct socket_server * socket_server_create();
+// thread is the number of socket threads, each one polls its own epoll, sockets are assigned by id
+struct socket_server * socket_server_create(int thread);
 void socket_server_release(struct socket_server *);
-int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);
+int socket_server_poll(struct socket_server *, int thread, struct socket_message *result, int *more);
 
 void socket_server_exit(struct socket_server *);
 void socket_server_close(struct socket_server *, uintptr_t opaque, int id);
 void socket_server_shutdown(struct socket_server *, uintptr_t opaque, int id);
 void socket_server_start(struct socket_server *, uintptr_t opaque, int id);
 
+// stop reading the socket until socket_server_resume, only in the thread of socket_server_poll which returns the socket
+void socket_server_pause(struct socket_server *, int id);
+// resume reading all the paused sockets of opaque
+void socket_server_resume(struct socket_server *, uintptr_t opaque);
+
 // return -1 when error
 int socket_server_send(struct socket_server *, int id, const void * buffer, int sz);
 int socket_server_send_lowpriority(struct socket_server *, int id, const void * buffer, int sz);
@@ -67,4 +74,11 @@ struct socket_object_interface {
 // if you send package sz == -1, use soi.
 void socket_server_userobject(struct socket_server *, struct socket_object_interface *soi);
 
+// socket_server_send writes in the calling thread when nothing is queued on the socket,
+// only the rest goes to the socket thread
+void socket_server_directwrite(struct socket_server *, int enable);
+
+// the syscalls which write data to the sockets, and the packages sent by them
+void socket_server_sendstat(struct socket_server *, uint64_t *syscall, uint64_t *message);
+
 #endif
@@ -0,0 +1,52 @@
+local skynet = require "skynet"
+
+local N = 10000
+
+skynet.start(function()
+	local fired = 0
+	local function f()
+		fired = fired + 1
+	end
+
+	local ti = skynet.hpc()
+	local ids = {}
+	for i = 1, N do
+		ids[i] = skynet.timeout(100, f)
+	end
+	for i = 1, N do
+		assert(skynet.cancel_timeout(ids[i]))
+	end
+	print(string.format("timeout + cancel : %d timers in %.1fms", N, (skynet.hpc() - ti) / 1e6))
+	assert(not skynet.cancel_timeout(ids[1]))
+
+	-- timeout 0 doesn't enter the wheel, the response is dropped
+	assert(skynet.cancel_timeout(skynet.timeout(0, f)))
+	-- cancel in half way
+	local half = {}
+	for i = 1, 100 do
+		half[i] = skynet.timeout(i % 20, f)
+	end
+	skynet.sleep(10)
+	local canceled = 0
+	for i = 1, 100 do
+		if skynet.cancel_timeout(half[i]) then
+			canceled = canceled + 1
+		end
+	end
+	print("fired", fired, "canceled", canceled)
+	assert(fired + canceled == 100)
+
+	-- the timer of sleep is canceled by wakeup
+	local co
+	skynet.fork(function()
+		co = coroutine.running()
+		assert(skynet.sleep(1000) == "BREAK")
+	end)
+	skynet.yield()
+	skynet.wakeup(co)
+
+	skynet.sleep(120)
+	assert(fired + canceled == 100)
+	print("CANCELTIMEOUT OK")
+	skynet.exit()
+end)
@@ -0,0 +1,81 @@
+local skynet = require "skynet"
+local socket = require "socket"
+
+-- Several services write to one connection at the same time, with large
+-- packages to fill the send buffer. Each line must arrive whole, and the lines
+-- of one service in order. Run it with socket_direct_write = true in config.
+
+local mode, fd = ...
+
+local PORT = 8770
+local WRITER = 4
+local LINE = 500
+
+local function size(i)
+	if i % 50 == 0 then
+		return 1024 * 1024
+	elseif i % 10 == 0 then
+		return 65536
+	else
+		return (i % 7) * 13
+	end
+end
+
+if mode == "writer" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, id)
+		fd = tonumber(fd)
+		for i = 1, LINE do
+			socket.write(fd, string.format("%d %d %s\n", id, i, string.rep("x", size(i))))
+			if i % 50 == 0 then
+				skynet.yield()
+			end
+		end
+		skynet.ret()
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local id = socket.listen("127.0.0.1", PORT)
+	socket.start(id, function(fd)
+		socket.close(id)
+		skynet.fork(function()
+			socket.start(fd)
+			local writer = {}
+			for i = 1, WRITER do
+				writer[i] = skynet.newservice(SERVICE_NAME, "writer", fd)
+			end
+			for i = 1, WRITER do
+				skynet.fork(skynet.call, writer[i], "lua", i)
+			end
+		end)
+	end)
+
+	local fd = assert(socket.open("127.0.0.1", PORT))
+	local last = {}
+	for i = 1, WRITER do
+		last[i] = 0
+	end
+	local ti = skynet.hpc()
+	for n = 1, WRITER * LINE do
+		local line = assert(socket.readline(fd))
+		local w, seq, data = line:match "^(%d+) (%d+) (x*)$"
+		w, seq = tonumber(w), tonumber(seq)
+		assert(w, line:sub(1, 32))
+		assert(seq == last[w] + 1, seq)
+		assert(#data == size(seq))
+		last[w] = seq
+		if n % 50 == 0 then
+			skynet.sleep(1)	-- read slowly, let the send buffer fill up
+		end
+	end
+	print(string.format("%d writers x %d lines : %.1fms", WRITER, LINE, (skynet.hpc() - ti) / 1000000))
+	socket.close(fd)
+	print("DIRECTWRITE OK")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,68 @@
+local skynet = require "skynet"
+
+-- Measure the latency of skynet.call between two services, with some busy
+-- services in the run queue. Run it with and without handoff = true in config.
+
+local mode = ...
+
+local ROUND = 10000
+local BUSY = 4
+
+if mode == "pong" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, ...)
+		skynet.ret(skynet.pack(...))
+	end)
+end)
+
+elseif mode == "busy" then
+
+local running = true
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		running = false
+		skynet.ret()
+	end)
+	skynet.fork(function()
+		while running do
+			local s = 0
+			for i = 1, 1000 do
+				s = s + i
+			end
+			skynet.yield()
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local pong = skynet.newservice(SERVICE_NAME, "pong")
+	local busy = {}
+	for i = 1, BUSY do
+		busy[i] = skynet.newservice(SERVICE_NAME, "busy")
+	end
+	local t = {}
+	for i = 1, ROUND do
+		local ti = skynet.hpc()
+		assert(skynet.call(pong, "lua", i) == i)
+		t[i] = skynet.hpc() - ti
+	end
+	for i = 1, BUSY do
+		skynet.call(busy[i], "lua")
+	end
+	table.sort(t)
+	local sum = 0
+	for _, v in ipairs(t) do
+		sum = sum + v
+	end
+	local function us(v) return string.format("%.1fus", v / 1000) end
+	print(string.format("call latency (%d rounds, %d busy services): avg %s p50 %s p99 %s",
+		ROUND, BUSY, us(sum / ROUND), us(t[ROUND//2]), us(t[math.ceil(ROUND*0.99)])))
+	print("HANDOFF OK")
+	skynet.exit()
+end)
+
+end
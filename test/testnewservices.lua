@@ -0,0 +1,61 @@
+local skynet = require "skynet"
+
+-- Compare launching services one by one with skynet.newservices.
+-- Run it with and without snlua_pool in config.
+
+local mode = ...
+
+local N = 1000
+
+if mode == "agent" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, cmd)
+		if cmd == "exit" then
+			skynet.ret()
+			skynet.exit()
+		else
+			skynet.ret(skynet.pack(skynet.self()))
+		end
+	end)
+end)
+
+elseif mode == "bad" then
+
+error "bad service"
+
+else
+
+local function check(list)
+	assert(#list == N)
+	for i = 1, N do
+		assert(skynet.call(list[i], "lua", "ping") == list[i])
+		skynet.call(list[i], "lua", "exit")
+	end
+end
+
+skynet.start(function()
+	print("snlua_pool", skynet.getenv "snlua_pool")
+	local ti = skynet.hpc()
+	local list = {}
+	for i = 1, N do
+		list[i] = skynet.newservice(SERVICE_NAME, "agent")
+	end
+	print(string.format("newservice : %d services in %.1fms", N, (skynet.hpc() - ti) / 1e6))
+	check(list)
+
+	ti = skynet.hpc()
+	list = skynet.newservices(N, SERVICE_NAME, "agent")
+	print(string.format("newservices : %d services in %.1fms", N, (skynet.hpc() - ti) / 1e6))
+	check(list)
+
+	local ok = pcall(skynet.newservice, SERVICE_NAME, "bad")
+	assert(not ok)
+	list = skynet.newservices(2, SERVICE_NAME, "bad")
+	assert(list[1] == false and list[2] == false)
+	assert(#skynet.newservices(0, SERVICE_NAME, "agent") == 0)
+	print("NEWSERVICES OK")
+	skynet.exit()
+end)
+
+end
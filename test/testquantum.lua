@@ -0,0 +1,90 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- Mixed load benchmark for the dispatch quantum.
+-- Some services are flooded with cheap messages, some get expensive ones,
+-- and a probe measures the round trip latency of a light service meanwhile.
+-- Compare the result with and without "quantum = 1000" in config. Use thread = 8 or
+-- more on a multicore machine, so that some workers have weight >= 0 and drain a
+-- whole heavy queue in one turn without the quantum.
+
+local mode = ...
+
+local function burn(ms)
+	local t = skynet.hpc() + ms * 1000000
+	while skynet.hpc() < t do end
+end
+
+if mode == "worker" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, cmd, arg)
+		if cmd == "cheap" then
+			-- do nothing
+		elseif cmd == "heavy" then
+			burn(arg)
+		elseif cmd == "ping" then
+			skynet.ret()
+		end
+	end)
+end)
+
+else
+
+local ROUND = 200
+local CHEAP = 8
+local HEAVY = 2
+
+skynet.start(function()
+	local cheap = {}
+	for i = 1, CHEAP do
+		cheap[i] = skynet.newservice(SERVICE_NAME, "worker")
+	end
+	local heavy = {}
+	for i = 1, HEAVY do
+		heavy[i] = skynet.newservice(SERVICE_NAME, "worker")
+	end
+	local probe = skynet.newservice(SERVICE_NAME, "worker")
+	local running = true
+	for i = 1, CHEAP do
+		skynet.fork(function()
+			while running do
+				for j = 1, 100 do
+					skynet.send(cheap[i], "lua", "cheap")
+				end
+				skynet.yield()
+			end
+		end)
+	end
+	for i = 1, HEAVY do
+		skynet.fork(function()
+			while running do
+				for j = 1, 2 do
+					skynet.send(heavy[i], "lua", "heavy", 1)
+				end
+				skynet.sleep(1)
+			end
+		end)
+	end
+
+	local t = {}
+	for i = 1, ROUND do
+		local ti = skynet.hpc()
+		skynet.call(probe, "lua", "ping")
+		t[i] = skynet.hpc() - ti
+		skynet.sleep(1)
+	end
+	running = false
+
+	table.sort(t)
+	local sum = 0
+	for _, v in ipairs(t) do
+		sum = sum + v
+	end
+	local function ms(v) return string.format("%.2fms", v / 1000000) end
+	print(string.format("probe latency (quantum = %s): avg %s p50 %s p99 %s max %s",
+		skynet.getenv "quantum", ms(sum / #t), ms(t[#t//2]), ms(t[math.ceil(#t*0.99)]), ms(t[#t])))
+	skynet.abort()
+end)
+
+end
@@ -0,0 +1,67 @@
+local skynet = require "skynet"
+require "skynet.manager"
+
+-- Compare sending to a local name (".sink"), which looks up the name on each
+-- send, with sending to the handle resolved once by skynet.localname.
+
+local mode = ...
+
+local ROUND = 100000
+local NAMES = 1000
+
+if mode == "sink" then
+
+local count = 0
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, cmd)
+		if cmd == "count" then
+			skynet.ret(skynet.pack(count))
+		else
+			count = count + 1
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local sink = skynet.newservice(SERVICE_NAME, "sink")
+	skynet.name(".sink", sink)
+	-- more names in the registry
+	for i = 1, NAMES do
+		skynet.name(".sink" .. i, sink)
+	end
+
+	local function bench(what, addr)
+		local ti = skynet.hpc()
+		for i = 1, ROUND do
+			skynet.send(addr, "lua", "ping")
+			if i % 1000 == 0 then
+				skynet.yield()
+			end
+		end
+		ti = skynet.hpc() - ti
+		print(string.format("%s : %d sends, %.1fns per send", what, ROUND, ti / ROUND))
+	end
+
+	bench("name", ".sink")
+	local handle = skynet.localname(".sink")
+	assert(handle == sink)
+	bench("handle", handle)
+	assert(skynet.call(sink, "lua", "count") == ROUND * 2)
+
+	-- the cached address of a name is dropped when the name is bound to a new service
+	local old = skynet.newservice(SERVICE_NAME, "sink")
+	skynet.name(".rebind", old)
+	skynet.send(".rebind", "lua", "ping")
+	skynet.kill(old)
+	local new = skynet.newservice(SERVICE_NAME, "sink")
+	skynet.name(".rebind", new)
+	skynet.send(".rebind", "lua", "ping")
+	assert(skynet.call(new, "lua", "count") == 1)
+	print("SENDNAME OK")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,81 @@
+local skynet = require "skynet"
+local socket = require "socket"
+
+-- Send bursts of small packages to one tcp connection and one udp socket. The
+-- packages queued in the socket thread are sent by one writev (or sendmmsg),
+-- socket.sendstat() tells how many syscalls a package costs.
+
+local PORT = 8771
+local UDP_PORT = 8772
+local BURST = 200
+local ROUND = 20
+
+local function report(name, s, m, ti)
+	local syscall, message = socket.sendstat()
+	syscall, message = syscall - s, message - m
+	print(string.format("%s : %d x %d packages, %d syscalls, %.3f syscalls per package, %.1fms",
+		name, ROUND, BURST, syscall, syscall / message, (skynet.hpc() - ti) / 1000000))
+	assert(message >= ROUND * BURST)
+end
+
+skynet.start(function()
+	local co = coroutine.running()
+	local recv = 0
+	local function arrive()
+		recv = recv + 1
+		if recv % BURST == 0 then
+			skynet.wakeup(co)
+		end
+	end
+
+	local id = socket.listen("127.0.0.1", PORT)
+	socket.start(id, function(fd)
+		socket.close(id)
+		skynet.fork(function()
+			socket.start(fd)
+			local n = 0
+			while true do
+				local line = socket.readline(fd)
+				if not line then
+					break
+				end
+				n = n + 1
+				assert(line == "package " .. n, line)
+				arrive()
+			end
+		end)
+	end)
+
+	local fd = assert(socket.open("127.0.0.1", PORT))
+	local s, m = socket.sendstat()
+	local ti = skynet.hpc()
+	local n = 0
+	for i = 1, ROUND do
+		for j = 1, BURST do
+			n = n + 1
+			socket.write(fd, "package " .. n .. "\n")
+		end
+		skynet.wait()
+	end
+	report("tcp", s, m, ti)
+	socket.close(fd)
+
+	recv = 0
+	local server = socket.udp(arrive, "127.0.0.1", UDP_PORT)
+	local c = socket.udp(function() end)
+	socket.udp_connect(c, "127.0.0.1", UDP_PORT)
+	s, m = socket.sendstat()
+	ti = skynet.hpc()
+	for i = 1, ROUND do
+		for j = 1, BURST do
+			socket.write(c, "package " .. j)
+		end
+		skynet.wait()
+	end
+	report("udp", s, m, ti)
+	socket.close(c)
+	socket.close(server)
+
+	print("SOCKETBATCH OK")
+	skynet.exit()
+end)
@@ -0,0 +1,79 @@
+local skynet = require "skynet"
+local socket = require "socket"
+
+-- Echo over many tcp connections and an udp socket. Run it with
+-- socket_thread = 4 in config, the connections are spread over the socket threads.
+
+local mode = ...
+
+local PORT = 8768
+local UDP_PORT = 8769
+local CONN = 64
+local ROUND = 200
+
+if mode == "echo" then
+
+skynet.start(function()
+	local id = socket.listen("127.0.0.1", PORT)
+	socket.start(id, function(fd)
+		skynet.fork(function()
+			socket.start(fd)
+			while true do
+				local line = socket.readline(fd)
+				if not line then
+					break
+				end
+				socket.write(fd, line .. "\n")
+			end
+			socket.close(fd)
+		end)
+	end)
+	local udp
+	udp = socket.udp(function(str, from)
+		socket.sendto(udp, from, str)
+	end, "127.0.0.1", UDP_PORT)
+end)
+
+else
+
+skynet.start(function()
+	skynet.newservice(SERVICE_NAME, "echo")
+	local ti = skynet.hpc()
+	local done = 0
+	local co = coroutine.running()
+	for i = 1, CONN do
+		skynet.fork(function()
+			local fd = assert(socket.open("127.0.0.1", PORT))
+			for j = 1, ROUND do
+				local msg = i .. ":" .. j
+				socket.write(fd, msg .. "\n")
+				assert(socket.readline(fd) == msg)
+			end
+			socket.close(fd)
+			done = done + 1
+			if done == CONN then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait()
+	print(string.format("%d connections x %d echo : %.1fms", CONN, ROUND, (skynet.hpc() - ti) / 1000000))
+
+	local recv = 0
+	local c = socket.udp(function(str)
+		recv = recv + 1
+		if recv == ROUND then
+			skynet.wakeup(co)
+		end
+	end)
+	socket.udp_connect(c, "127.0.0.1", UDP_PORT)
+	for i = 1, ROUND do
+		socket.write(c, "hello " .. i)
+	end
+	skynet.wait()
+	print("udp echo", recv)
+	print("SOCKETTHREAD OK")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,85 @@
+local skynet = require "skynet"
+
+-- Many services arm the same heartbeat with skynet.timeout_group, the timers
+-- expire at the same tick share one node in the timer wheel.
+
+local mode = ...
+
+local AGENT = 100
+local N = 20000
+
+if mode == "agent" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		local beat = 0
+		local co = coroutine.running()
+		local function heartbeat()
+			beat = beat + 1
+			if beat == 5 then
+				skynet.wakeup(co)
+			else
+				skynet.timeout_group(10, heartbeat)
+			end
+		end
+		local ti = skynet.now()
+		skynet.timeout_group(10, heartbeat)
+		skynet.wait()
+		skynet.ret(skynet.pack(skynet.now() - ti))
+	end)
+end)
+
+else
+
+local function bench(name, f)
+	local fired = 0
+	local co = coroutine.running()
+	local function cb()
+		fired = fired + 1
+		if fired == N then
+			skynet.wakeup(co)
+		end
+	end
+	local ti = skynet.hpc()
+	for i = 1, N do
+		f(10, cb)
+	end
+	local arm = skynet.hpc() - ti
+	skynet.wait()
+	print(string.format("%s : %d timers, arm %.1fms", name, N, arm / 1000000))
+end
+
+skynet.start(function()
+	bench("timeout", skynet.timeout)
+	bench("timeout_group", skynet.timeout_group)
+
+	-- canceled, the response is dropped
+	local canceled = true
+	local id = skynet.timeout_group(1, function() canceled = false end)
+	assert(skynet.cancel_timeout(id))
+	skynet.sleep(5)
+	assert(canceled)
+
+	local agent = {}
+	for i = 1, AGENT do
+		agent[i] = skynet.newservice(SERVICE_NAME, "agent")
+	end
+	local done = 0
+	local co = coroutine.running()
+	for i = 1, AGENT do
+		skynet.fork(function()
+			local elapsed = skynet.call(agent[i], "lua")
+			assert(elapsed >= 50, elapsed)	-- never early
+			done = done + 1
+			if done == AGENT then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait()
+	print(string.format("%d agents x 5 heartbeats", AGENT))
+	print("TIMERGROUP OK")
+	skynet.exit()
+end)
+
+end
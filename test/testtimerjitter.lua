@@ -0,0 +1,67 @@
+local skynet = require "skynet"
+
+-- Timer jitter, and the cost of an idle node : cpu time and thread wakeups
+-- (context switches) of the whole process while nothing is running.
+-- Idle statistics read /proc, so they are linux only.
+
+local ROUND = 200
+local IDLE = 300	-- 3 seconds
+
+local function proc_stat()
+	local f = io.open "/proc/self/stat"
+	if not f then
+		return
+	end
+	local s = f:read "a"
+	f:close()
+	local pid = tonumber(s:match "^(%d+)")
+	-- utime and stime are the 14th and 15th fields, after the command name in ()
+	local utime, stime = s:match("%)%s+%S+" .. string.rep("%s+%S+", 10) .. "%s+(%d+)%s+(%d+)")
+	local switches = 0
+	local ls = io.popen("ls /proc/" .. pid .. "/task")
+	for tid in ls:lines() do
+		local st = io.open(string.format("/proc/%d/task/%s/status", pid, tid))
+		if st then
+			local text = st:read "a"
+			st:close()
+			switches = switches + tonumber(text:match "voluntary_ctxt_switches:%s*(%d+)")
+				+ tonumber(text:match "nonvoluntary_ctxt_switches:%s*(%d+)")
+		end
+	end
+	ls:close()
+	return tonumber(utime) + tonumber(stime), switches
+end
+
+local function jitter(name, f, ti, expect)
+	local t = {}
+	for i = 1, ROUND do
+		local start = skynet.hpc()
+		f(ti)
+		t[i] = (skynet.hpc() - start) / 1e6 - expect
+	end
+	table.sort(t)
+	local sum = 0
+	for _, v in ipairs(t) do
+		sum = sum + math.abs(v)
+	end
+	print(string.format("%s(%d) : error avg %.3fms p50 %.3fms p99 %.3fms", name, ti,
+		sum / ROUND, t[ROUND // 2], t[math.ceil(ROUND * 0.99)]))
+end
+
+skynet.start(function()
+	print("timer_resolution", skynet.getenv "timer_resolution")
+	jitter("sleep", skynet.sleep, 1, 10)
+	jitter("sleep_ms", skynet.sleep_ms, 5, 5)
+
+	local cpu, switches = proc_stat()
+	if cpu then
+		skynet.sleep(IDLE)
+		local cpu2, switches2 = proc_stat()
+		local sec = IDLE / 100
+		-- cpu time is in clock ticks, usually 1/100 second
+		print(string.format("idle : cpu %.1f%%, %.0f context switches per second",
+			(cpu2 - cpu) / sec, (switches2 - switches) / sec))
+	end
+	print("TIMERJITTER OK")
+	skynet.exit()
+end)
@@ -0,0 +1,52 @@
+local skynet = require "skynet"
+
+-- Run it with timer_resolution = 1000 in config to get 1ms timers,
+-- the default resolution is 10ms.
+
+local ROUND = 100
+
+local function measure(f, ti)
+	local t = {}
+	for i = 1, ROUND do
+		local start = skynet.hpc()
+		f(ti)
+		t[i] = (skynet.hpc() - start) / 1e6
+	end
+	table.sort(t)
+	local sum = 0
+	for _, v in ipairs(t) do
+		sum = sum + v
+	end
+	return sum / ROUND, t[ROUND // 2], t[ROUND]
+end
+
+skynet.start(function()
+	local resolution = tonumber(skynet.getenv "timer_resolution")
+	print("timer_resolution", resolution)
+	local tick = 1000 / resolution
+	for _, ti in ipairs { 1, 2, 5 } do
+		local avg, p50, max = measure(skynet.sleep_ms, ti)
+		print(string.format("sleep_ms(%d) : avg %.2fms p50 %.2fms max %.2fms", ti, avg, p50, max))
+		-- a timeout may fire up to one tick earlier, it starts from the middle of a tick
+		assert(p50 > math.max(ti, tick) - tick)
+	end
+	local avg, p50 = measure(skynet.sleep, 1)
+	print(string.format("sleep(1) : avg %.2fms p50 %.2fms", avg, p50))
+	assert(p50 > 10 - tick)
+
+	local co = coroutine.running()
+	local ms = false
+	skynet.timeout_ms(20, function() ms = true end)
+	skynet.timeout(3, function() skynet.wakeup(co) end)
+	skynet.wait()
+	assert(ms)
+
+	-- skynet.now() is always in 1/100 second
+	local now = skynet.now()
+	skynet.sleep(50)
+	local diff = skynet.now() - now
+	print("skynet.now() after sleep(50)", diff)
+	assert(diff >= 49 and diff <= 60)
+	print("TIMERMS OK")
+	skynet.exit()
+end)
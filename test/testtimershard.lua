@@ -0,0 +1,60 @@
+local skynet = require "skynet"
+
+-- Many services arm and cancel timers at the same time. Each service lands in
+-- its own timer wheel (see skynet_timer.c), so they don't contend on one lock.
+
+local mode = ...
+
+local SERVICE = 16
+local N = 2000
+
+if mode == "slave" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		local fired = 0
+		local co = coroutine.running()
+		local function f()
+			fired = fired + 1
+			if fired == N // 2 then
+				skynet.wakeup(co)
+			end
+		end
+		for i = 1, N do
+			local id = skynet.timeout(i % 10 + 1, f)
+			if i % 2 == 0 then
+				assert(skynet.cancel_timeout(id))
+			end
+		end
+		skynet.wait()
+		skynet.sleep(20)	-- canceled timers never fire
+		skynet.ret(skynet.pack(fired))
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local slave = {}
+	for i = 1, SERVICE do
+		slave[i] = skynet.newservice(SERVICE_NAME, "slave")
+	end
+	local ti = skynet.hpc()
+	local done = 0
+	local co = coroutine.running()
+	for i = 1, SERVICE do
+		skynet.fork(function()
+			assert(skynet.call(slave[i], "lua") == N // 2)
+			done = done + 1
+			if done == SERVICE then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait()
+	print(string.format("%d services x %d timers : %.1fms", SERVICE, N, (skynet.hpc() - ti) / 1000000))
+	print("TIMERSHARD OK")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,34 @@
+local skynet = require "skynet"
+
+-- Stop the whole process for a second, the timer thread catches up in one
+-- pass when it resumes: every timer fires once, in the order of deadline.
+
+local N = 100
+
+skynet.start(function()
+	local before = skynet.timerskew()
+	local order = {}
+	local co = coroutine.running()
+	for i = 1, N do
+		skynet.timeout(i, function()
+			order[#order+1] = i
+			if #order == N then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	local far = false
+	skynet.timeout(1000, function() far = true end)
+	-- $PPID of the shell (and its subshell) is skynet
+	os.execute("(kill -STOP $PPID; sleep 1; kill -CONT $PPID) &")
+	skynet.wait()
+	for i = 1, N do
+		assert(order[i] == i, i)
+	end
+	assert(not far)
+	local skew = skynet.timerskew()
+	print("skew", skew.count - before.count, "max lag", skew.maxlag .. "ms")
+	assert(skew.count > before.count and skew.maxlag >= 500)
+	print("TIMERSKEW OK")
+	skynet.exit()
+end)
@@ -0,0 +1,70 @@
+local skynet = require "skynet"
+local socket = require "socket"
+
+-- Flood an udp socket, the socket thread reads the packages by recvmmsg and
+-- sends several of them to the service in one message. Every package must
+-- arrive whole, in order, with the address of the sender.
+
+local mode = ...
+
+local PORT = 8773
+local BURST = 100
+local ROUND = 50
+
+local function size(i)
+	if i % BURST == 0 then
+		return 30000
+	else
+		return i % 17 * 11
+	end
+end
+
+if mode == "recv" then
+
+skynet.start(function()
+	local recv = 0
+	local waiting
+	local message = skynet.stat "message"
+	socket.udp(function(str, from)
+		recv = recv + 1
+		local seq, data = str:match "^(%d+):(x*)$"
+		assert(tonumber(seq) == recv, seq)
+		assert(#data == size(recv))
+		assert(socket.udp_address(from) == "127.0.0.1")
+		if waiting and recv >= waiting.n then
+			skynet.wakeup(waiting.co)
+		end
+	end, "127.0.0.1", PORT)
+	skynet.dispatch("lua", function(_,_, n)
+		if recv < n then
+			waiting = { n = n, co = coroutine.running() }
+			skynet.wait()
+			waiting = nil
+		end
+		skynet.ret(skynet.pack(recv, skynet.stat "message" - message))
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local r = skynet.newservice(SERVICE_NAME, "recv")
+	local c = socket.udp(function() end)
+	socket.udp_connect(c, "127.0.0.1", PORT)
+	local ti = skynet.hpc()
+	local n = 0
+	for i = 1, ROUND do
+		for j = 1, BURST do
+			n = n + 1
+			socket.write(c, n .. ":" .. string.rep("x", size(n)))
+		end
+		skynet.call(r, "lua", n)
+	end
+	local recv, message = skynet.call(r, "lua", n)
+	print(string.format("%d packages in %d messages : %.1fms", recv, message, (skynet.hpc() - ti) / 1000000))
+	socket.close(c)
+	print("UDPBATCH OK")
+	skynet.exit()
+end)
+
+end
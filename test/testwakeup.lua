@@ -0,0 +1,40 @@
+local skynet = require "skynet"
+local socket = require "socket"
+
+-- Measure the latency from a socket event to the dispatch in an idle node.
+-- Each round sends an udp package to self and waits for it. All the workers are
+-- parked between rounds, so the latency includes waking a worker up.
+
+local ROUND = 1000
+local PORT = 8766
+
+skynet.start(function()
+	local t = {}
+	local sendtime
+	local co
+	local host
+	host = socket.udp(function(str, from)
+		t[#t+1] = skynet.hpc() - sendtime
+		skynet.wakeup(co)
+	end, "127.0.0.1", PORT)
+	local c = socket.udp(function() end)
+	socket.udp_connect(c, "127.0.0.1", PORT)
+	co = coroutine.running()
+	for i=1,ROUND do
+		skynet.sleep(1)	-- let all the workers go to sleep
+		sendtime = skynet.hpc()
+		socket.write(c, "ping")
+		skynet.wait()
+	end
+	table.sort(t)
+	local sum = 0
+	for _, v in ipairs(t) do
+		sum = sum + v
+	end
+	local function us(v) return string.format("%.1fus", v / 1000) end
+	print(string.format("wakeup latency (%d rounds): avg %s p50 %s p99 %s max %s",
+		#t, us(sum / #t), us(t[#t//2]), us(t[math.ceil(#t*0.99)]), us(t[#t])))
+	socket.close(c)
+	socket.close(host)
+	skynet.exit()
+end)
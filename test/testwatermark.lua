@@ -0,0 +1,129 @@
+local skynet = require "skynet"
+local socket = require "socket"
+
+local mode = ...
+
+local PORT = 8767
+local SIZE = 1024 * 1024
+
+if mode == "slave" then
+
+local CMD = {}
+local count = 0
+local answer
+
+function CMD.work()
+	local s = 0
+	for i = 1, 10000 do
+		s = s + i
+	end
+	count = count + 1
+end
+
+function CMD.stat()
+	return count, skynet.watermark()
+end
+
+-- the response must arrive even if this service is saturated then
+function CMD.ask(master)
+	answer = skynet.call(master, "lua", "ping")
+end
+
+function CMD.answer()
+	return answer
+end
+
+function CMD.recv()
+	skynet.watermark(8, 2)
+	local id = socket.listen("127.0.0.1", PORT)
+	local total = 0
+	local co = coroutine.running()
+	socket.start(id, function(fd)
+		socket.start(fd)
+		socket.close(id)
+		while true do
+			local str = socket.read(fd)
+			if not str then
+				break
+			end
+			total = total + #str
+			CMD.work()	-- read slowly, let the socket messages queue up
+		end
+		socket.close(fd)
+		skynet.wakeup(co)
+	end)
+	skynet.wait()
+	return total
+end
+
+skynet.start(function()
+	skynet.watermark(64, 16)
+	skynet.dispatch("lua", function(_,_, cmd, ...)
+		local f = CMD[cmd]
+		skynet.ret(skynet.pack(f(...)))
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local reply
+	skynet.dispatch("lua", function(_,_, cmd)
+		assert(cmd == "ping")
+		reply = skynet.response()
+	end)
+	local slave = skynet.newservice(SERVICE_NAME, "slave")
+	skynet.send(slave, "lua", "ask", skynet.self())
+	while not reply do
+		skynet.yield()
+	end
+	local reject = 0
+	for i = 1, 1000 do
+		if skynet.send(slave, "lua", "work") == false then
+			reject = reject + 1
+			if reply then
+				-- respond while the slave is saturated
+				assert(reply(true, "pong"))
+				reply = nil
+			end
+		end
+	end
+	print("rejected", reject)
+	assert(reject > 0)
+	local ok, err = pcall(skynet.call, slave, "lua", "stat")
+	print("call when saturated", ok, err)
+	while true do
+		local ok, count, len, high, low, saturated = pcall(skynet.call, slave, "lua", "stat")
+		if ok then
+			print("processed", count, "mqlen", len, "watermark", high, low, saturated)
+			assert(count == 1000 - reject)
+			break
+		end
+		skynet.sleep(1)
+	end
+
+	local answer = skynet.call(slave, "lua", "answer")
+	print("answer when saturated", answer)
+	assert(answer == "pong")
+
+	-- the socket of a saturated service stops reading until it drains, but no data is lost
+	skynet.fork(function()
+		local fd
+		repeat
+			skynet.sleep(1)
+			fd = socket.open("127.0.0.1", PORT)
+		until fd
+		local chunk = string.rep("x", 1024)
+		for i = 1, SIZE // #chunk do
+			socket.write(fd, chunk)
+		end
+		socket.close(fd)
+	end)
+	local total = skynet.call(slave, "lua", "recv")
+	print("received", total)
+	assert(total == SIZE)
+	print("WATERMARK OK")
+	skynet.exit()
+end)
+
+end